@@ -0,0 +1,68 @@
+/*
+-----------------------------------------------------------------------------
+    ChangeFilter
+    Suppression of the output lines that did not change since last emitted
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef CHANGE_FILTER_H
+#define CHANGE_FILTER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "ProcFile.h"
+
+/*
+ A series is told by the measurement and the tags of its line. A line is
+ emitted if it is of a new series, if it has other fields than the last one
+ emitted, or if any of its fields has changed beyond the deadband since then:
+ by more than the absolute deadband and by more than the relative one (of the
+ last emitted value). The ranks (*_rank fields) are held to the relative one
+ only: a move among the top ones counts, a shuffle among the ties of the tail
+ does not.
+ Every so many cycles, a keyframe emits all the lines; the series not seen
+ since the previous keyframe are forgotten then.
+*/
+class ChangeFilter
+{
+    struct Series
+    {
+        std::string         fields;     // their names, as last emitted
+        std::vector<double> values;
+        unsigned            seen;       // cycle
+    };
+
+    std::unordered_map<std::string, Series> series;
+    double      relative;
+    double      absolute;
+    unsigned    keyframe;
+    unsigned    cycle;
+    OVLValue    suppressed;
+
+    bool changed(const std::string& names, const std::vector<double>& values,
+                 const std::vector<bool>& rank, const Series& last) const;
+
+public:
+    // the relative deadband is a fraction; a keyframe every so many cycles (0 for never)
+    ChangeFilter(double relative, double absolute, unsigned keyframe);
+
+    // Start a new cycle
+    void next_cycle();
+
+    // True if the line (without its newline) is to be emitted
+    bool pass(const std::string& line);
+
+    // The lines to be emitted, out of the given ones
+    std::string filter(const std::string& lines);
+
+    bool is_keyframe() const { return keyframe && cycle % keyframe == 0; }
+
+    // Lines suppressed in the current cycle
+    OVLValue get_suppressed() const { return suppressed; }
+};
+
+#endif      // CHANGE_FILTER_H
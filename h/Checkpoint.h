@@ -0,0 +1,52 @@
+/*
+-----------------------------------------------------------------------------
+    Checkpoint
+    The baseline counters, kept in a memory-mapped file across restarts
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include "CpuUsage.h"
+#include "MonPID.h"
+
+// A checkpoint older than this is not worth reloading (sec)
+#define CHECKPOINT_MAX_AGE  600
+
+/*
+ The file holds a header, with the CPU totals of /proc/stat, followed by one
+ fixed-size record per process. It is rewritten in place after every cycle;
+ the header is completed last, so a checkpoint cut short (e.g. a crash in
+ between) is not taken for a valid one.
+ A checkpoint is only valid for the same boot (the timestamps are monotonic
+ and the pids recycled), the same record layout, and while it is recent.
+*/
+class Checkpoint
+{
+    struct Header;
+
+    std::string path;
+    int         fd;
+    char*       map;
+    size_t      map_size;
+    char        boot_id[40];
+
+    bool remap(size_t size);
+
+public:
+    explicit Checkpoint(const std::string& path);
+    ~Checkpoint();
+
+    // Save the CPU totals and the process records
+    bool save(const CpuUsage& cpu, const std::vector<PidCheckpoint>& records);
+
+    // Load them back; false if there is no valid checkpoint
+    bool load(CpuUsage& cpu, std::vector<PidCheckpoint>& records);
+};
+
+#endif      // CHECKPOINT_H
@@ -58,4 +58,9 @@ public:
 // Return true if a valid delta could be computed
 extern bool getCPU(unsigned* delta);
 
+// The data of the last getCPU(), which the next one is compared with;
+// they can be restored (e.g. after a restart), for the next one to return a valid delta
+extern const CpuUsage& lastCPU();
+extern void setLastCPU(const CpuUsage& cpu);
+
 #endif      // CPU_USAGE_H
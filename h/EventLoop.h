@@ -0,0 +1,99 @@
+/*
+-----------------------------------------------------------------------------
+    EventLoop
+    Single-threaded dispatch of the signals, timers and descriptors (epoll)
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+
+#include "ProcFile.h"
+
+/*
+ Everything procstat waits on comes through a single epoll(7) set:
+ - the signals, blocked and read from a signalfd(2), so none interrupts a
+   cycle and their handlers run in between, like any other event;
+ - the timers, as timerfd(2)s, of which the handlers get the number of their
+   expirations since the last one (more than 1 when a cycle made them late);
+ - the sources that have the descriptors of their own, to poll(2) for: their
+   set is taken before every wait, and they serve the ones that are ready.
+ The tasks posted by the handlers run after all the events of a wait, one
+ after the other; a cycle is such a task.
+*/
+class EventLoop
+{
+public:
+    typedef std::function<void()> Handler;
+    typedef std::function<void(uint64_t expirations)> TimerHandler;
+    typedef std::function<void(std::vector<pollfd>& fds)> PollFds;
+    typedef std::function<bool(const std::vector<pollfd>& fds)> Serve;
+
+private:
+    struct Source
+    {
+        PollFds             poll_fds;
+        Serve               serve;
+        std::vector<pollfd> fds;        // of the last wait
+        bool                served;     // since the last sync, so its numbers may have been reused
+    };
+
+    // A descriptor of a source, as it was last put in the set
+    struct SourceFd
+    {
+        size_t      source;
+        uint32_t    events;
+        bool        polled;             // false: always ready (a file)
+    };
+
+    int         epoll_fd;
+    int         signal_fd;
+    sigset_t    signals;
+    bool        running;
+    std::unordered_map<int, Handler>        sig_handlers;
+    std::unordered_map<int, TimerHandler>   timers;
+    std::vector<Source>                     sources;
+    std::unordered_map<int, SourceFd>       source_fds;     // the descriptors of the sources, in the set
+    std::vector<int>                        always_ready;   // of the sources, that epoll does not take (files)
+    std::deque<Handler>                     tasks;
+
+    void read_signals();
+    void read_timer(int fd);
+    void sync_sources();
+
+public:
+    EventLoop();
+    ~EventLoop();
+
+    bool ready() const { return epoll_fd >= 0 && signal_fd >= 0; }
+
+    // Deliver a signal to the handler (instead of its disposition)
+    bool add_signal(int sig, Handler handler);
+
+    // A new timer, stopped; -1 on failure
+    int add_timer(TimerHandler handler);
+    // Fire every interval (nsec) from now on, first at the given delay (or the interval); 0 to stop
+    bool set_timer(int timer, OVLValue interval_ns, OVLValue delay_ns = 0);
+
+    // The descriptors of the source, polled along with the rest
+    void add_source(PollFds poll_fds, Serve serve);
+
+    // Run the task after the events of the current wait
+    void post(Handler task) { tasks.push_back(task); }
+
+    // Dispatch the events, until stopped
+    void run();
+    void stop() { running = false; }
+};
+
+#endif      // EVENT_LOOP_H
@@ -0,0 +1,74 @@
+/*
+-----------------------------------------------------------------------------
+    FlightRecorder
+    The full history of the processes, in a ring file of a fixed size
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <string>
+#include <vector>
+#include "RecorderFormat.h"
+#include "ProcFile.h"
+
+// Every so many frames, one does not depend on the previous ones
+#define RECORDER_KEYFRAME   30
+
+/*
+ The file is of the layout of RecorderFormat.h, which is all that a reader
+ needs. A file of the same size, left by a previous run (or a crash), is
+ carried on; otherwise it is started over.
+*/
+class FlightRecorder
+{
+    struct Row
+    {
+        pid_t       pid;
+        std::string name;
+        uint64_t    values[REC_COLUMNS];
+    };
+
+    std::string     path;
+    char*           map;
+    size_t          map_size;
+    RecorderHeader* header;
+    RecorderIndex*  index;
+    char*           data;
+    uint64_t        oldest_seq;     // the oldest frame that may still be in the index
+    unsigned        since_keyframe;
+
+    // the frame being written, and the previous one (sorted by pid)
+    std::vector<Row> rows;
+    std::vector<Row> previous;
+    RecorderFrame   frame;
+    std::string     buff;
+
+    void encode();
+    void drop_overwritten(uint64_t start, uint64_t end);
+
+public:
+    FlightRecorder(const std::string& path, size_t data_size);
+    ~FlightRecorder();
+
+    bool ready() const { return map != NULL; }
+
+    // Start a new frame
+    void begin(unsigned ncores, uint64_t cpu_jiffies);
+
+    // The values of the next process of the frame
+    uint64_t* add(pid_t pid, const std::string& name);
+
+    // Append the frame to the ring
+    void commit();
+
+    // Size of the last frame
+    size_t get_frame_bytes() const { return buff.size(); }
+    // Time span of the frames in the ring (nsec)
+    uint64_t get_span_ns() const;
+};
+
+#endif      // FLIGHT_RECORDER_H
@@ -0,0 +1,83 @@
+/*
+-----------------------------------------------------------------------------
+    MetricsServer
+    Exposition of the metrics to Prometheus, over HTTP
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <poll.h>
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "ProcFile.h"
+
+#define METRICS_MAX_CLIENTS 16
+#define METRICS_MAX_REQUEST 8192        // bytes of the request head
+#define METRICS_TIMEOUT_MS  10000       // for a connection to be served, from its accept
+#define METRICS_PATH        "/metrics"
+
+/*
+ It listens on a Unix socket (a path, only accessible by the owner: 0600) or on
+ a TCP port ("[host:]port", on the loopback by default), for plain HTTP/1.x
+ GETs of /metrics. The response is rendered once per cycle, headers included,
+ and shared by all the scrapes until the next one: a scrape costs the send(2)
+ of the buffer, whenever it comes, and never causes a scan. Every connection serves one request (and is
+ closed after its response); the sockets are non-blocking and are polled by
+ the main loop, like the query ones. A connection not served in time (e.g.
+ one that sends nothing) is closed, so that idle ones cannot hold all the
+ slots.
+*/
+class MetricsServer
+{
+    struct Client
+    {
+        int         fd;
+        std::string in;                             // the request head, read so far
+        std::shared_ptr<const std::string> out;     // the response being sent
+        size_t      sent;
+        OVLValue    accepted_ns;
+    };
+
+    std::string         address;
+    std::string         path;       // of a Unix socket
+    int                 listen_fd;
+    std::vector<Client> clients;
+    std::shared_ptr<const std::string> response;
+    OVLValue            scrapes;
+
+    bool listen_unix();
+    bool listen_tcp();
+    void accept_clients();
+    bool receive(Client& client);
+    bool send(Client& client);
+    void disconnect(Client& client);
+    static std::shared_ptr<const std::string> reply(const char* status, const std::string& body);
+
+public:
+    explicit MetricsServer(const std::string& address);
+    ~MetricsServer();
+
+    bool ready() const { return listen_fd >= 0; }
+
+    // Replace the body of the responses, in the Prometheus text format
+    void publish(const std::string& body);
+
+    // Append the descriptors to poll for
+    void poll_fds(std::vector<pollfd>& fds) const;
+
+    // Serve the descriptors that are ready; true if any was
+    bool serve(const std::vector<pollfd>& fds);
+
+    // Close the connections that have run out of time
+    void expire(OVLValue now_ns);
+
+    OVLValue get_scrapes() const { return scrapes; }
+};
+
+#endif      // METRICS_SERVER_H
@@ -12,37 +12,199 @@
 
 #include <unistd.h>
 #include <string>
+#include <memory>
+#include <unordered_map>
 #include <linux/taskstats.h>
 #include "ProcFile.h"
+#include "ProcMatcher.h"
+
+// Fields of /proc/<pid>/stat (numbered as in proc(5)), up to the last one we need
+enum {
+    STAT_PPID   = 4,
+    STAT_MINFLT = 10,
+    STAT_MAJFLT = 12,
+    STAT_UTIME  = 14,
+    STAT_STIME  = 15,
+    STAT_CUTIME = 16,
+    STAT_CSTIME = 17,
+    STAT_PRIORITY = 18,
+    STAT_NICE   = 19,
+    STAT_NUM_THREADS = 20,
+    STAT_STARTTIME = 22,
+    STAT_NFIELDS
+};
+
+// Parse the numeric fields of /proc/<pid>/stat, which follow the ')' of the process name
+void parse_stat_fields(const char* cp, OVLValue fields[STAT_NFIELDS]);
+
+// Per-thread usage, for the breakdown of the top processes
+struct ThreadStats
+{
+    std::string     name;
+    OVLValue        cpu_total;          // utime + stime, in jiffies
+    OVLValue        cpu_delta;
+    // following delay fields are in nanoseconds
+    OVLValue        cpu_delay_total;
+    OVLValue        cpu_delay_delta;
+    OVLValue        blkio_delay_total;
+    OVLValue        blkio_delay_delta;
+    bool            primed;             // true, once the deltas are valid
+    bool            found;
+};
+typedef std::unordered_map<pid_t, ThreadStats> mThreadStats;
+
+// The baseline of a process, as saved across restarts: what its next update() needs
+// to compute its deltas. Plain data, to be kept in a file as is
+struct PidCheckpoint
+{
+    pid_t           pid;
+    pid_t           ppid;
+    OVLValue        starttime;
+    OVLValue        sample_ns;
+    OVLValue        cpu_total;
+    OVLValue        cchild_total;
+    OVLValue        minflt_total;
+    OVLValue        majflt_total;
+    OVLValue        nvcsw_total;
+    OVLValue        nivcsw_total;
+    OVLValue        read_bytes;
+    OVLValue        write_bytes;
+    OVLValue        blkio_delay_total;
+    OVLValue        swapin_delay_total;
+    OVLValue        cpu_delay_total;
+};
+
+// The metrics that the processes are ranked by
+enum RankedMetric {
+    RANK_CPU,
+    RANK_RSS,
+    RANK_READ_BYTES,
+    RANK_WRITE_BYTES,
+    RANK_BLKIO_DELAY,
+    RANK_SWAPIN_DELAY,
+    RANK_CPU_DELAY,
+    RANK_MAJOR_FAULTS,
+    RANK_INVOL_CTXT_SWITCHES,
+    RANK_RSS_GROWTH,
+    RANKED_METRICS
+};
+
+// Samples of the RSS that its trend is taken over
+#define RSS_TREND_SAMPLES   8
+
+// Updates of a new (or just exec'd) process at which the command line rules are matched again,
+// since it may still rewrite its command line (e.g. the postgres backends, with setproctitle)
+#define CMDLINE_RECHECKS    3
+
+// The files read on every update (kept in MonPID.cpp)
+struct ProcFiles;
+class ProcBatch;
 
 class MonPID
 {
     pid_t	        pid;
+    pid_t           ppid;
+    OVLValue        starttime;          // in clock ticks after boot; tells apart a recycled pid
     std::string	    name;
     OVLValue        cpu_total;
     OVLValue        cpu_delta;
+    // CPU of the reaped children (cutime + cstime)
+    OVLValue        cchild_total;
+    OVLValue        cchild_delta;
+    OVLValue        cchild_discount;    // CPU of the children reaped since, not yet taken off
     OVLValue        vmRSS;
+    OVLValue        vmSwap;
+    OVLValue        rssAnon;
+    OVLValue        rssFile;
+    OVLValue        num_threads;
+    uid_t           uid;                // the real one; -1 until known
+    long long       priority;
+    long long       nice;
+    OVLValue        sample_ns;          // monotonic time of the latest read
+    OVLValue        interval_ns;        // time between the latest two reads
+    double          cycle_share;        // of interval_ns, spanned by the current cycle (below 1 after a skip)
+    // the *_rate fields are per second
     OVLValue        read_bytes;
-    OVLValue        read_bytes_delta;
+    OVLValue        read_bytes_rate;
     OVLValue        write_bytes;
-    OVLValue        write_bytes_delta;
-    // following delay fields are in nanoseconds
+    OVLValue        write_bytes_rate;
+    // following delay fields are in nanoseconds (per second, for the rates)
     OVLValue        blkio_delay_total;
-    OVLValue        blkio_delay_delta;
+    OVLValue        blkio_delay_rate;
     OVLValue        swapin_delay_total;
-    OVLValue        swapin_delay_delta;
+    OVLValue        swapin_delay_rate;
     OVLValue        cpu_delay_total;
-    OVLValue        cpu_delay_delta;
+    OVLValue        cpu_delay_rate;
+    OVLValue        minflt_total;
+    OVLValue        minflt_rate;
+    OVLValue        majflt_total;
+    OVLValue        majflt_rate;
+    OVLValue        nvcsw_total;        // voluntary context switches
+    OVLValue        nvcsw_rate;
+    OVLValue        nivcsw_total;       // involuntary context switches
+    OVLValue        nivcsw_rate;
+
+    // the trend of the RSS: its last samples, in a ring, with their times (sec) relative to the
+    // latest one; and their least-squares slope
+    float           rss_times[RSS_TREND_SAMPLES];
+    float           rss_values[RSS_TREND_SAMPLES];
+    OVLValue        rss_latest_ns;
+    unsigned char   rss_samples;
+    unsigned char   rss_next;
+    float           rss_growth;         // bytes per minute
+
+    // proportional and unique set sizes, from smaps_rollup; only read on demand
+    OVLValue        pss;
+    OVLValue        uss;
+    OVLValue        pss_ns;             // monotonic time of their last read; 0 if never
+    bool            pss_valid;          // false, if the last read failed
+
+    // /proc/<pid>/stat and status, with their descriptors kept open from cycle to cycle
+    std::shared_ptr<ProcFiles> files;
+
+    // per-thread usage; only kept while the process is tracked for the breakdown
+    std::shared_ptr<mThreadStats> threads;
 
     bool            found;              // set to true, if the update gets successful
+    unsigned        stale_cycles;       // cycles since the last update, when skipped for budget
     bool            initial_sample;     // true, during the first sampling
+    unsigned        taskstat_epoch;     // the taskstats totals are baselines of another epoch
+
+    unsigned char   match;              // ProcMatcher::Result of the include/exclude rules
+    unsigned        match_epoch;        // the rules that it was matched with
+    unsigned char   cmdline_checks;     // times the command line was matched, up to CMDLINE_RECHECKS
+
+    // exponentially weighted moving averages of the ranked metrics, when enabled
+    float           smoothed[RANKED_METRICS];
+    bool            smoothed_primed;    // false, until the first update with rates
 
     static bool skip_taskstat;
+    static bool taskstat_enabled;
+    static unsigned taskstat_epochs;    // times the taskstats have been (re)enabled or reconnected
+    static bool taskstat_lost;          // the netlink connection failed, and is to be re-established
+    static const ProcMatcher* matcher;
+    static unsigned match_epochs;       // times the rules have been replaced
+    static OVLValue pid_reuses;         // recycled pids detected so far
+    static float smoothing;             // weight of the latest values in the averages; 0 for none
+    static OVLValue cycle_ns;           // time since the previous scan; 0 if unknown
 
     int fetch_taskstats(pid_t pid, taskstats* ts);
+    // The part of a delta (since the previous read) that falls in the current cycle
+    OVLValue in_cycle(OVLValue delta) const { return OVLValue(delta * cycle_share + 0.5); }
+    void update_thread(pid_t tid, const taskstats& ts);
+    void parse_status(const char* data);
+    void reinit();
+    void apply_rules();
+    void smooth();
+    void track_rss(OVLValue now_ns);
 
 public:
     MonPID(pid_t = 0);
+    // A process known before a restart, to be updated (it is not read here)
+    explicit MonPID(const PidCheckpoint& cp);
+
+    // Save the baseline of the next update
+    void checkpoint(PidCheckpoint& cp) const;
 
 
 /* Upate the monitored PID data or return false if the PID is no longer accessible.
@@ -52,21 +214,86 @@ public:
 */
     bool update();
 
+    // Queue the reads of the next update() into a batch; false if there is no room left
+    bool queue_reads(ProcBatch& batch);
+    // Drop the reads of a batch, when this update is skipped
+    void discard_reads();
+
     void trace() const;
 
     void set_found(bool v) { found = v; };
     bool isfound() const { return found; };
+    // Carry over the last values, skipping the update of this cycle
+    void mark_stale() { found = true; stale_cycles++; }
+    unsigned get_stale_cycles() const { return stale_cycles; }
     std::string get_name() const { return name; }
     pid_t get_pid() const { return pid; }
+    pid_t get_ppid() const { return ppid; }
+    OVLValue get_starttime() const { return starttime; }
+    static OVLValue get_pid_reuses() { return pid_reuses; }
+    // Enable or disable the taskstats; the netlink connection is established by the next update
+    static void set_taskstats(bool on);
+    // Replace the include/exclude rules; every process is matched again by its next update
+    static void set_matcher(const ProcMatcher* rules);
+    // Keep the moving averages of the ranked metrics, with the given weight (0 < alpha <= 1) of
+    // the latest values; 0 to stop them
+    static void set_smoothing(float alpha) { smoothing = alpha; }
+    // The time since the previous scan; the CPU deltas (per cycle) of the processes that were
+    // skipped for the budget are scaled down to it
+    static void set_cycle_ns(OVLValue ns) { cycle_ns = ns; }
+    bool is_included() const { return match == ProcMatcher::INCLUDE; }
+    bool is_excluded() const { return match == ProcMatcher::EXCLUDE; }
     void set_name(std::string str) { name = str; }
     OVLValue get_cpu() const { return cpu_delta; }
+    OVLValue get_cchild_cpu() const { return cchild_delta; }
     OVLValue get_RSS() const { return vmRSS; }
-    OVLValue get_read_bytes_delta() const { return read_bytes_delta; }
-    OVLValue get_write_bytes_delta() const { return write_bytes_delta; }
-    OVLValue get_blkio_delay_delta() const { return blkio_delay_delta; }
-    OVLValue get_swapin_delay_delta() const { return swapin_delay_delta; }
-    OVLValue get_cpu_delay_delta() const { return cpu_delay_delta; }
+    OVLValue get_read_bytes_rate() const { return read_bytes_rate; }
+    OVLValue get_write_bytes_rate() const { return write_bytes_rate; }
+    OVLValue get_blkio_delay_rate() const { return blkio_delay_rate; }
+    OVLValue get_swapin_delay_rate() const { return swapin_delay_rate; }
+    OVLValue get_cpu_delay_rate() const { return cpu_delay_rate; }
+    OVLValue get_swap() const { return vmSwap; }
+    OVLValue get_RSS_anon() const { return rssAnon; }
+    OVLValue get_RSS_file() const { return rssFile; }
+    // Growth of the RSS (bytes per minute; negative, for a shrinking one)
+    long long get_RSS_growth() const { return (long long) rss_growth; }
+    OVLValue get_num_threads() const { return num_threads; }
+    uid_t get_uid() const { return uid; }
+    long long get_priority() const { return priority; }
+    long long get_nice() const { return nice; }
+    OVLValue get_minor_faults_rate() const { return minflt_rate; }
+    OVLValue get_major_faults_rate() const { return majflt_rate; }
+    OVLValue get_vol_ctxt_switches_rate() const { return nvcsw_rate; }
+    OVLValue get_invol_ctxt_switches_rate() const { return nivcsw_rate; }
+
+    OVLValue get_interval_ns() const { return interval_ns; }
+
+    // The latest value of a ranked metric, and the one to rank by: its moving average, if enabled
+    OVLValue get_raw(RankedMetric metric) const;
+    double get_ranked(RankedMetric metric) const
+    { return smoothing > 0 ? smoothed[metric] : get_raw(metric); }
+
+    // Read the PSS and USS from /proc/<pid>/smaps_rollup (expensive: it walks the page tables)
+    bool update_pss();
+    OVLValue get_pss() const { return pss; }
+    OVLValue get_uss() const { return uss; }
+    OVLValue get_pss_ns() const { return pss_ns; }
+    bool has_pss() const { return pss_valid; }
+
+    // Track (or stop tracking) the per-thread usage; it needs the taskstats
+    void set_thread_tracking(bool on);
+    const mThreadStats* get_threads() const { return threads.get(); }
+
+    // Discount the CPU of a reaped child, which was already accounted while it was running;
+    // it is taken off the reaped CPU of the next update, whichever order they come in
+    void discount_reaped(OVLValue child_cpu) { cchild_discount += child_cpu; }
+    // Account the CPU of the reaped children as own CPU (for subtree totals)
+    void fold_reaped() { cpu_delta += cchild_delta; }
+    // All the CPU jiffies consumed by this process and its reaped children
+    OVLValue get_cpu_lifetime() const { return cpu_total + cchild_total; }
 
+    // An empty total, to sum processes into; it is keyed by the given id
+    static MonPID make_total(pid_t key);
     MonPID& operator+=(const MonPID& right);
 
     friend bool compare_by_CPU(const MonPID&, const MonPID&);
@@ -76,6 +303,9 @@ public:
     friend bool compare_by_cpu_delay(const MonPID&, const MonPID&);
     friend bool compare_by_blkio_delay(const MonPID&, const MonPID&);
     friend bool compare_by_swapin_delay(const MonPID&, const MonPID&);
+    friend bool compare_by_major_faults(const MonPID&, const MonPID&);
+    friend bool compare_by_invol_ctxt_switches(const MonPID&, const MonPID&);
+    friend bool compare_by_RSS_growth(const MonPID&, const MonPID&);
 
 };
 
@@ -88,5 +318,8 @@ bool compare_by_IO_Write_Bytes(const MonPID&, const MonPID&);
 bool compare_by_cpu_delay(const MonPID&, const MonPID&);
 bool compare_by_blkio_delay(const MonPID&, const MonPID&);
 bool compare_by_swapin_delay(const MonPID&, const MonPID&);
+bool compare_by_major_faults(const MonPID&, const MonPID&);
+bool compare_by_invol_ctxt_switches(const MonPID&, const MonPID&);
+bool compare_by_RSS_growth(const MonPID&, const MonPID&);
 
 #endif      // PROC_USAGE_H
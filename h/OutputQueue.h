@@ -0,0 +1,68 @@
+/*
+-----------------------------------------------------------------------------
+    OutputQueue
+    Non-blocking writes of the output, through a bounded queue of cycles
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <poll.h>
+#include <string>
+#include <deque>
+#include <vector>
+
+#include "ProcFile.h"
+
+/*
+ The output of a cycle is queued as a whole (a batch), and written out as far
+ as the descriptor takes it, which is made non-blocking: when the consumer
+ stalls (e.g. telegraf with its buffer full, or restarting), the batches wait
+ in the queue, and the main loop polls the descriptor for more room, while the
+ cycles go on at their own pace. Once the queue is full, either the oldest
+ batch or the newest one is dropped; a batch is never cut short, so the
+ consumer only ever gets whole lines.
+*/
+class OutputQueue
+{
+    int                     fd;
+    int                     flags;      // of the descriptor, to restore
+    std::deque<std::string> batches;
+    size_t                  written;    // of the front batch
+    size_t                  limit;      // batches
+    bool                    drop_newest;
+    OVLValue                dropped;
+    OVLValue                stall_ns;   // total time with a batch pending on the consumer
+    OVLValue                stall_start;
+
+    void write_out();
+
+public:
+    explicit OutputQueue(int fd);
+    ~OutputQueue();
+
+    // The number of batches to keep, and which one to drop when they are more
+    void set_limit(size_t batches, bool drop_newest);
+
+    // Queue the output of a cycle, and write as much of it as possible
+    void push(std::string batch);
+
+    // Append the descriptor to poll for, while there is output pending
+    void poll_fds(std::vector<pollfd>& fds) const;
+
+    // Write out more, if the descriptor is ready; true if it was
+    bool serve(const std::vector<pollfd>& fds);
+
+    // Write out the pending output, waiting up to the given time for the consumer
+    void drain(unsigned timeout_ms);
+
+    size_t get_pending() const { return batches.size(); }
+    OVLValue get_dropped() const { return dropped; }
+    // including the current stall, if any
+    OVLValue get_stall_ns() const { return stall_ns + (stall_start ? monotonic_ns() - stall_start : 0); }
+};
+
+#endif      // OUTPUT_QUEUE_H
@@ -0,0 +1,72 @@
+/*
+-----------------------------------------------------------------------------
+    Pressure
+    Pressure Stall Information (PSI) of the host
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef PRESSURE_H
+#define PRESSURE_H
+
+#include "ProcFile.h"
+
+#define PROC_PRESSURE   "/proc/pressure/"
+
+/*
+ /proc/pressure/{cpu,io,memory} hold two lines, of the share of time that
+ some (or all, for 'full') of the non-idle tasks were stalled on the resource:
+
+    some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    full avg10=0.00 avg60=0.00 avg300=0.00 total=0
+
+ The averages are percentages; the totals are the cumulative stall time, in usec.
+ The files are kept open and re-read like /proc/stat. A kernel without PSI
+ (or booted with psi=0) has no such files, or fails their reads.
+*/
+class Pressure
+{
+public:
+    enum { CPU, IO, MEMORY, NRESOURCES };
+    enum { SOME, FULL, NLINES };
+
+    struct Stall
+    {
+        float       avg10;
+        float       avg60;
+        OVLValue    total;          // usec
+        OVLValue    total_delta;    // usec, since the previous read
+    };
+
+    struct Resource
+    {
+        const char*     name;
+        char            path[32];
+        ProcFileData    file;
+        bool            available;
+        bool            primed;     // true, once the deltas are valid
+        Stall           stall[NLINES];
+
+        Resource(const char* name);
+    };
+
+private:
+    Resource*   resources[NRESOURCES];
+
+    static void parse(const char* line, Stall& stall, bool primed);
+
+public:
+    Pressure();
+    ~Pressure();
+
+    // Read all the resources; false if none is available
+    bool refresh();
+
+    const Resource& get(int resource) const { return *resources[resource]; }
+
+    // The highest 'some' avg10 of all the resources (%)
+    float max_some_avg10() const;
+};
+
+#endif      // PRESSURE_H
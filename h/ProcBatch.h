@@ -0,0 +1,78 @@
+/*
+-----------------------------------------------------------------------------
+    ProcBatch
+    Batched reads of /proc files, with io_uring
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef PROC_BATCH_H
+#define PROC_BATCH_H
+
+#include <linux/io_uring.h>
+#include "ProcFile.h"
+
+// Reads per batch, and the largest read of each
+#define BATCH_SLOTS     512
+#define BATCH_SLOT_SIZE FILEBUFF
+
+/*
+ The reads of a batch are all submitted with a single io_uring_enter(2), each
+ into its own slot of a buffer registered with the kernel (IORING_OP_READ_FIXED,
+ at offset 0), and the completions are handed over to their files with
+ ProcFileData::fill(); the next refresh() of each file then costs no syscall.
+ The slots are left as they are until the next run(), for those refresh() calls.
+ The ring is set up with the raw syscalls; if the kernel does not support it
+ (or it is disabled), ready() is false and the files are read one by one.
+*/
+class ProcBatch
+{
+    struct Ring
+    {
+        unsigned*   head;
+        unsigned*   tail;
+        unsigned    mask;
+        unsigned*   array;      // SQ only
+        void*       ptr;
+        size_t      size;
+    };
+
+    int             ring_fd;
+    Ring            sq, cq;
+    io_uring_sqe*   sqes;
+    size_t          sqes_size;
+    io_uring_cqe*   cqes;
+    bool            fixed;      // whether the slots are registered buffers
+
+    char*           arena;      // the slots of the reads
+    ProcFileData*   files[BATCH_SLOTS];
+    unsigned        queued;
+
+    // Cost of the batches
+    OVLValue        n_reads = 0;
+    OVLValue        n_enters = 0;
+
+    void teardown();
+
+public:
+    ProcBatch();
+    ~ProcBatch();
+
+    // Whether io_uring is available
+    bool ready() const { return ring_fd >= 0; }
+
+    // Free slots in the batch
+    unsigned room() const { return BATCH_SLOTS - queued; }
+
+    // Queue a read of the whole file; false if it cannot be opened, or the batch is full
+    bool add(ProcFileData* file);
+
+    // Submit the queued reads and hand each one over to its file, as they complete
+    void run();
+
+    OVLValue get_reads() const { return n_reads; }
+    OVLValue get_enters() const { return n_enters; }
+};
+
+#endif      // PROC_BATCH_H
@@ -0,0 +1,41 @@
+/*
+-----------------------------------------------------------------------------
+    ProcDir
+    Fast listing of the numeric entries (pids, tids) of a /proc directory
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef PROC_DIR_H
+#define PROC_DIR_H
+
+#include <sys/types.h>
+#include <vector>
+
+// Buffer for the directory entries; enough for some thousands of them per syscall
+#define DIRBUFF     256 * 1024
+
+/*
+ The directory is read with getdents64(2) into a large buffer, which is reused
+ from call to call, and the numeric names are converted in place; the other
+ entries are skipped with a look at their first character.
+*/
+class ProcDir
+{
+    char*   m_buffer;
+    size_t  m_size;
+
+public:
+    ProcDir(size_t size = DIRBUFF);
+    ~ProcDir();
+
+    // List the numeric entries of the directory, in ascending order
+    bool list(const char* path, std::vector<pid_t>& pids);
+
+    // Merge the sorted lists of two successive listings, to find the added and the gone pids
+    static void diff(const std::vector<pid_t>& prev, const std::vector<pid_t>& curr,
+                     std::vector<pid_t>& added, std::vector<pid_t>& gone);
+};
+
+#endif      // PROC_DIR_H
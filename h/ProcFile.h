@@ -11,6 +11,7 @@
 #define PROCFILE_H
 
 #include <stdio.h>
+#include <time.h>
 
 typedef unsigned long long OVLValue;
 
@@ -31,6 +32,14 @@ typedef unsigned long long OVLValue;
 #define OvlDebug(msg, ...)
 #endif
 
+// Monotonic clock, in nanoseconds
+inline OVLValue monotonic_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 class ProcFileData
 {
 private:
@@ -41,17 +50,36 @@ private:
     // Working data
     int		m_fd;           // File descriptor: -1 until opened
     int     m_length;       // Amount read last time
+    int     m_errno;        // Of the last failed open or read; 0 if none
     char*	m_data;         // Data read buffer
+    bool    m_owned;        // false, if the buffer is shared with other files
+    OVLValue m_read_ns;     // Monotonic time of the last read
+    bool    m_filled;       // Data read ahead (e.g. by a batch), for the next refresh
+    const char* m_ahead;    // where they are, until then
+    int     m_ahead_length;
 
 public:
-    ProcFileData (const char path[] = NULL, size_t size = FILEBUFF);
+    // The buffer (of size + 1 bytes) may be shared by many files, so that they do not hold
+    // one each; the data read are then valid until the next refresh() of any of them
+    ProcFileData (const char path[] = NULL, size_t size = FILEBUFF, char* buffer = NULL);
     ~ProcFileData ();
 
-    // Open or rewind, then reread the current contents of the file
+    // Open if needed, then reread the current contents of the file
     bool refresh ();
 
+    // Open the file, unless it is already open; return its descriptor or -1
+    int open ();
+
     // Close the file, forcing a re-open on the next access
     void close ();
+    bool is_open () const { return m_fd >= 0; }
+
+    // Take the contents of a read done elsewhere; the next refresh() returns them, and
+    // they are to be left in place until then
+    void fill (const char* data, int length, OVLValue read_ns);
+
+    // Drop the contents read ahead, if not taken
+    void discard ()     { m_filled = false; }
 
     // Access to initialized data
     const char* path ()   const { return m_path; }
@@ -61,6 +89,8 @@ public:
     // Read-only access to the data read
     const char* data ()   const { return m_data; }
     size_t      length () const { return m_length; }
+    OVLValue    read_ns () const { return m_read_ns; }
+    int         error () const   { return m_errno; }
 
     // Common method searches the data for the string 'name'
     // and returns 0 for not found or content following the name
@@ -0,0 +1,70 @@
+/*
+-----------------------------------------------------------------------------
+    ProcMatcher
+    Include/exclude rules of the processes, by name or command line
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef PROC_MATCHER_H
+#define PROC_MATCHER_H
+
+#include <regex.h>
+#include <string>
+#include <vector>
+#include <unordered_set>
+
+// Prefixes of the rules
+#define RULE_REGEX      "re:"       // a regular expression (POSIX extended), rather than a glob
+#define RULE_CMDLINE    "cmd:"      // on the command line, rather than on the name
+
+/*
+ A rule is either an exact name, a glob (with '*', '?' or '[...]'), or a
+ regular expression; it applies to the process name (comm), or to its full
+ command line. The exact names are kept in a hash set, and all the globs and
+ regular expressions of the same kind (include/exclude, name/command line) are
+ compiled together into a single alternation, so that a process is matched
+ with at most one regexec() per kind.
+ The exclude rules take precedence over the include ones.
+*/
+class ProcMatcher
+{
+public:
+    enum Result { NONE, INCLUDE, EXCLUDE };
+
+private:
+    struct RuleSet
+    {
+        std::unordered_set<std::string> names;
+        std::vector<std::string>        patterns;   // as regular expressions
+        regex_t                         regex;
+        bool                            compiled = false;
+
+        bool match(const std::string& str) const;
+    };
+
+    enum { INCLUDE_NAME, INCLUDE_CMDLINE, EXCLUDE_NAME, EXCLUDE_CMDLINE, NSETS };
+    RuleSet sets[NSETS];
+
+    static std::string glob_to_regex(const std::string& glob);
+
+public:
+    ProcMatcher() {}
+    ~ProcMatcher();
+    ProcMatcher(const ProcMatcher&) = delete;
+    ProcMatcher& operator=(const ProcMatcher&) = delete;
+
+    // Add a rule; throws std::invalid_argument for an invalid regular expression
+    void add(const std::string& rule, bool exclude);
+
+    // Compile the rules added, once they are all there
+    void compile();
+
+    // Whether any rule needs the command line
+    bool needs_cmdline() const;
+
+    Result match(const std::string& name, const std::string& cmdline) const;
+};
+
+#endif      // PROC_MATCHER_H
@@ -0,0 +1,69 @@
+/*
+-----------------------------------------------------------------------------
+    ProcTree
+    Parent/child relationships of the running processes
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef PROC_TREE_H
+#define PROC_TREE_H
+
+#include <sys/types.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/*
+ The tree is kept up to date incrementally: every scanned process reports its
+ (possibly changed) parent with update(), and every process that has gone away
+ is dropped with remove(). A parent may be referenced before it is itself
+ reported; its children list is simply waiting for it.
+*/
+class ProcTree
+{
+    typedef std::unordered_set<pid_t> pidSet;
+
+    std::unordered_map<pid_t, pid_t>  parents;
+    std::unordered_map<pid_t, pidSet> children;
+
+    void unlink(pid_t pid, pid_t ppid);
+
+public:
+    // Record the parent of a process; cheap when nothing has changed
+    void update(pid_t pid, pid_t ppid);
+
+    // Forget a process that is no longer running
+    void remove(pid_t pid);
+
+    // Parent of a process, or 0 if unknown
+    pid_t get_parent(pid_t pid) const;
+
+    // Processes in the tree
+    size_t size() const { return parents.size(); }
+
+    // All the processes that are 'depth' levels below the top of the tree
+    // (depth 0 are the processes without a parent, i.e. init and kthreadd)
+    std::vector<pid_t> at_depth(unsigned depth) const;
+
+    // Call visit(pid) for the given process and all of its descendants
+    template <typename F>
+    void walk(pid_t root, F visit) const
+    {
+        std::vector<pid_t> stack(1, root);
+        // a racy re-parenting could momentarily form a loop; never visit more than all
+        size_t budget = parents.size() + 1;
+        while (!stack.empty() && budget--) {
+            pid_t pid = stack.back();
+            stack.pop_back();
+            visit(pid);
+
+            auto it = children.find(pid);
+            if (it != children.end())
+                stack.insert(stack.end(), it->second.begin(), it->second.end());
+        }
+    }
+};
+
+#endif      // PROC_TREE_H
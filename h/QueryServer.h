@@ -0,0 +1,82 @@
+/*
+-----------------------------------------------------------------------------
+    QueryServer
+    Request/response queries over a Unix domain socket
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef QUERY_SERVER_H
+#define QUERY_SERVER_H
+
+#include <poll.h>
+#include <string>
+#include <vector>
+#include <functional>
+#include <ostream>
+
+#include "ProcFile.h"
+
+#define QUERY_MAX_CLIENTS   16
+#define QUERY_MAX_REQUEST   1024        // bytes of a request line
+#define QUERY_MAX_PENDING   (4 << 20)   // bytes of the responses not read yet by a client
+#define QUERY_IDLE_MS       30000       // without a request, or a response taken, to be disconnected
+
+/*
+ A request is a single line of text; its response is a number of lines,
+ terminated by an empty one, so that a client can send several requests over
+ the same connection. All the sockets are non-blocking and are polled by the
+ main loop along with the signals, so a query is served in between two cycles
+ and never holds one back. A client that sends an overlong request, does not
+ read its responses, or stays idle for too long, is disconnected.
+ The socket is only accessible by the owner (0600).
+*/
+class QueryServer
+{
+public:
+    // Writes the response to a request
+    typedef std::function<void(const std::string& request, std::ostream& response)> Handler;
+
+private:
+    struct Client
+    {
+        int         fd;
+        std::string in;         // the part of a request read so far
+        std::string out;        // the responses not sent yet
+        bool        eof;        // no more requests; closed once the responses are sent
+        OVLValue    active_ns;  // of its last request or response taken (or its accept)
+    };
+
+    std::string         path;
+    int                 listen_fd;
+    std::vector<Client> clients;
+    Handler             handler;
+    OVLValue            requests;
+    OVLValue            dropped;
+
+    void accept_clients();
+    bool receive(Client& client);
+    bool send(Client& client);
+    void disconnect(Client& client);
+
+public:
+    QueryServer(const std::string& path, Handler handler);
+    ~QueryServer();
+
+    bool ready() const { return listen_fd >= 0; }
+
+    // Append the descriptors to poll for
+    void poll_fds(std::vector<pollfd>& fds) const;
+
+    // Serve the descriptors that are ready; true if any was
+    bool serve(const std::vector<pollfd>& fds);
+
+    // Disconnect the clients idle for too long
+    void expire(OVLValue now_ns);
+
+    OVLValue get_requests() const { return requests; }
+    OVLValue get_dropped() const { return dropped; }
+};
+
+#endif      // QUERY_SERVER_H
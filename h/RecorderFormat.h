@@ -0,0 +1,297 @@
+/*
+-----------------------------------------------------------------------------
+    RecorderFormat
+    Layout of the flight-recorder ring file, and its reader
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef RECORDER_FORMAT_H
+#define RECORDER_FORMAT_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+
+#define RECORDER_MAGIC      0x52465350      // "PSFR"
+#define RECORDER_VERSION    1
+// Frames the index has room for
+#define RECORDER_INDEX      16384
+
+/*
+ The file holds a header, an index of the frames and the ring of the frames.
+ A frame is the table of all the processes of a cycle, stored by column:
+ the pids (sorted, as the gaps from the previous pid), the names (an index
+ in the name table of the frame, or 0 for the same name as in the previous
+ frame), then every metric of REC_COLUMNS. Every value is written as a
+ variable-length integer (7 bits per byte); the metrics are the difference
+ (zigzag-encoded) from the value of the same pid in the previous frame, or
+ from 0 in a keyframe and for a new pid. In every column, a run of zeros is
+ written as a single 0 and the count of the rest. So, the unchanged values cost next
+ to nothing, and a frame can only be decoded after all the frames since the
+ last keyframe.
+ The frames are appended in the ring, wrapping around at its end; the oldest
+ frames that are overwritten are dropped from the index first, and a frame is
+ added to the index only after it is written whole ('seq' is set last). So,
+ the file is always valid, also after a crash of procstat, and any number of
+ readers can read it while it is written.
+*/
+enum RecorderColumn {
+    REC_PPID,
+    REC_UID,
+    REC_STARTTIME,      // clock ticks after boot
+    REC_CPU,            // jiffies, over the polling period
+    REC_THREADS,
+    REC_RSS,            // KB
+    REC_SWAP,           // KB
+    REC_READ_BYTES,     // per sec, as the rest
+    REC_WRITE_BYTES,
+    REC_CPU_DELAY,      // nsec/sec
+    REC_BLKIO_DELAY,    // nsec/sec
+    REC_SWAPIN_DELAY,   // nsec/sec
+    REC_MINOR_FAULTS,
+    REC_MAJOR_FAULTS,
+    REC_VOL_CTXT,
+    REC_INVOL_CTXT,
+    REC_COLUMNS
+};
+
+struct RecorderHeader
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    header_size;
+    uint32_t    index_size;     // entries
+    uint32_t    columns;
+    uint32_t    pad;
+    uint64_t    data_size;      // bytes of the ring
+    uint64_t    seq;            // of the last frame
+    uint64_t    head;           // where the next frame goes, in the ring
+};
+
+struct RecorderIndex
+{
+    uint64_t    seq;            // 0 for none; set last
+    uint64_t    time_ns;        // CLOCK_REALTIME
+    uint64_t    offset;         // in the ring
+    uint32_t    length;
+    uint32_t    keyframe;
+};
+
+struct RecorderFrame
+{
+    uint64_t    seq;
+    uint64_t    time_ns;
+    uint64_t    cpu_jiffies;    // of all the cores, over the polling period
+    uint32_t    length;         // with this header
+    uint32_t    count;
+    uint32_t    keyframe;
+    uint32_t    ncores;
+};
+
+inline size_t recorder_data_offset()
+{
+    return sizeof(RecorderHeader) + RECORDER_INDEX * sizeof(RecorderIndex);
+}
+
+inline void put_varint(std::string& buff, uint64_t value)
+{
+    while (value >= 0x80) {
+        buff += char(value | 0x80);
+        value >>= 7;
+    }
+    buff += char(value);
+}
+
+// False past the end, or for a value too long
+inline bool get_varint(const char*& pos, const char* end, uint64_t& value)
+{
+    value = 0;
+    for (unsigned shift = 0; pos < end && shift < 64; shift += 7) {
+        uint8_t byte = *pos++;
+        value |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// A column of values, with the runs of zeros as a 0 and their length less one
+inline void put_column(std::string& buff, const std::vector<uint64_t>& values)
+{
+    for (size_t i = 0; i < values.size(); ) {
+        put_varint(buff, values[i]);
+        if (values[i++])
+            continue;
+        size_t run = i;
+        while (run < values.size() && values[run] == 0)
+            run++;
+        put_varint(buff, run - i);
+        i = run;
+    }
+}
+
+inline bool get_column(const char*& pos, const char* end, std::vector<uint64_t>& values, size_t count)
+{
+    values.clear();
+    uint64_t value, run;
+    while (values.size() < count) {
+        if (!get_varint(pos, end, value))
+            return false;
+        values.push_back(value);
+        if (value)
+            continue;
+        if (!get_varint(pos, end, run) || run > count - values.size())
+            return false;
+        values.resize(values.size() + run, 0);
+    }
+    return true;
+}
+
+inline uint64_t zigzag(int64_t value) { return (uint64_t(value) << 1) ^ uint64_t(value >> 63); }
+inline int64_t unzigzag(uint64_t value) { return int64_t(value >> 1) ^ -int64_t(value & 1); }
+
+
+// A process, as decoded from a frame
+struct RecorderProcess
+{
+    pid_t       pid;
+    std::string name;
+    uint64_t    values[REC_COLUMNS];
+};
+
+typedef std::unordered_map<pid_t, RecorderProcess> RecorderProcesses;
+
+class RecorderReader
+{
+    const char* map;
+    size_t      map_size;
+
+    const RecorderHeader* header() const { return (const RecorderHeader*) map; }
+    const RecorderIndex* index() const { return (const RecorderIndex*) (map + sizeof(RecorderHeader)); }
+
+public:
+    RecorderReader() : map(NULL), map_size(0) {}
+    ~RecorderReader() { if (map) munmap((void*) map, map_size); }
+
+    // Map the file; false if it is not there, or of another layout
+    bool open(const char* path)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void* ptr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t) recorder_data_offset())
+            ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (ptr == MAP_FAILED)
+            return false;
+        map = (const char*) ptr;
+        map_size = st.st_size;
+
+        const RecorderHeader* h = header();
+        if (h->magic != RECORDER_MAGIC || h->version != RECORDER_VERSION ||
+            h->header_size != sizeof(RecorderHeader) || h->index_size != RECORDER_INDEX ||
+            h->columns != REC_COLUMNS || recorder_data_offset() + h->data_size > map_size) {
+            munmap((void*) map, map_size);
+            map = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    // The frames in the ring, the oldest first
+    std::vector<RecorderIndex> frames() const
+    {
+        std::vector<RecorderIndex> entries;
+        for (unsigned i = 0; i < RECORDER_INDEX; i++) {
+            RecorderIndex entry = index()[i];
+            if (entry.seq)
+                entries.push_back(entry);
+        }
+        std::sort(entries.begin(), entries.end(),
+            [](const RecorderIndex& a, const RecorderIndex& b) { return a.seq < b.seq; });
+        return entries;
+    }
+
+    // Decode a frame on top of the previous one (as decoded into 'procs', of 'last_seq').
+    // False if it cannot be: a frame after a gap (until the next keyframe), or one overwritten
+    bool decode(const RecorderIndex& entry, uint64_t& last_seq, RecorderProcesses& procs,
+                RecorderFrame& frame) const
+    {
+        if (!entry.keyframe && (last_seq == 0 || entry.seq != last_seq + 1))
+            return false;
+        last_seq = 0;
+        if (entry.length < sizeof(RecorderFrame) || entry.offset + entry.length > header()->data_size)
+            return false;
+
+        // copy it out, then check that it was not overwritten in the meantime
+        const char* data = map + recorder_data_offset();
+        std::string buff(data + entry.offset, entry.length);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&index()[entry.seq % RECORDER_INDEX].seq, __ATOMIC_RELAXED) != entry.seq)
+            return false;
+        memcpy(&frame, buff.data(), sizeof frame);
+        if (frame.seq != entry.seq || frame.length != entry.length)
+            return false;
+
+        const char* pos = buff.data() + sizeof frame;
+        const char* end = buff.data() + buff.size();
+        uint64_t value;
+
+        std::vector<std::string> names;
+        if (!get_varint(pos, end, value))
+            return false;
+        for (uint64_t n = value; n; n--) {
+            if (!get_varint(pos, end, value) || value > uint64_t(end - pos))
+                return false;
+            names.push_back(std::string(pos, value));
+            pos += value;
+        }
+
+        std::vector<RecorderProcess> rows(frame.count);
+        std::vector<const RecorderProcess*> prev(frame.count);
+        std::vector<uint64_t> column;
+        if (!get_column(pos, end, column, frame.count))
+            return false;
+        pid_t pid = 0;
+        for (uint32_t i = 0; i < frame.count; i++)
+            rows[i].pid = pid += pid_t(column[i]) + 1;
+        if (!get_column(pos, end, column, frame.count))
+            return false;
+        for (uint32_t i = 0; i < frame.count; i++) {
+            auto it = frame.keyframe ? procs.end() : procs.find(rows[i].pid);
+            prev[i] = (it == procs.end()) ? NULL : &it->second;
+            if (column[i] > names.size())
+                return false;
+            if (column[i])
+                rows[i].name = names[column[i] - 1];
+            else if (prev[i])
+                rows[i].name = prev[i]->name;
+        }
+        for (unsigned c = 0; c < REC_COLUMNS; c++) {
+            if (!get_column(pos, end, column, frame.count))
+                return false;
+            for (uint32_t i = 0; i < frame.count; i++)
+                rows[i].values[c] = (prev[i] ? prev[i]->values[c] : 0) + unzigzag(column[i]);
+        }
+
+        procs.clear();
+        for (RecorderProcess& row : rows)
+            procs[row.pid] = row;
+        last_seq = entry.seq;
+        return true;
+    }
+};
+
+#endif      // RECORDER_FORMAT_H
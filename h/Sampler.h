@@ -0,0 +1,84 @@
+/*
+-----------------------------------------------------------------------------
+    Sampler
+    High-frequency sampling of a few candidate processes, in between polls
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+#include "ProcFile.h"
+
+// Samples kept per process; enough for a 30 sec polling period at 250 msec
+#define SAMPLE_RING     128
+
+// Summary of the samples of a polling period
+struct SampleStats
+{
+    float avg, max, p95;
+};
+
+/*
+ Each sampled process only costs the reads of /proc/<pid>/stat (CPU) and
+ /proc/<pid>/io (read/written bytes), with their file descriptors kept open.
+ The samples are per-second rates, kept in fixed-size rings; when a ring is
+ full, the oldest samples are overwritten.
+*/
+class Sampler
+{
+    enum { CPU, READ, WRITE, NMETRICS };
+
+    struct Ring
+    {
+        char            stat_path[32];
+        char            io_path[32];
+        ProcFileData    stat;
+        ProcFileData    io;
+        OVLValue        starttime;
+        OVLValue        last[NMETRICS];     // the latest cumulative counters
+        OVLValue        last_ns;
+        bool            primed;             // true, once 'last' holds a valid read
+        bool            io_readable;        // false, once /proc/<pid>/io has failed
+        unsigned        head, count;
+        float           samples[NMETRICS][SAMPLE_RING];
+
+        explicit Ring(pid_t pid);
+        bool sample(double ticks_per_sec);
+    };
+
+    std::unordered_map<pid_t, Ring*> rings;
+    double ticks_per_sec;
+
+    // Cost of the sampling
+    OVLValue n_samples = 0;
+    OVLValue time_ns = 0;
+
+    static SampleStats stats(const float* samples, unsigned count);
+
+public:
+    Sampler();
+    ~Sampler();
+
+    // Replace the sampled processes (keeping the rings of those that remain)
+    void set_candidates(const std::vector<pid_t>& pids);
+
+    // Take a sample of all the candidates
+    void sample();
+
+    // Summaries of the samples of a process since the last reset; false if there are none
+    bool summary(pid_t pid, SampleStats& cpu, SampleStats& read, SampleStats& write) const;
+
+    // Start a new polling period
+    void reset();
+
+    OVLValue get_samples() const { return n_samples; }
+    OVLValue get_time_us() const { return time_ns / 1000; }
+};
+
+#endif      // SAMPLER_H
@@ -0,0 +1,57 @@
+/*
+-----------------------------------------------------------------------------
+    Snapshot
+    Publication of the processes of every cycle, in shared memory
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <unordered_map>
+#include "SnapshotFormat.h"
+#include "ProcFile.h"
+
+/*
+ The segment (e.g. in /dev/shm) is of the layout of SnapshotFormat.h, which is
+ all that a reader needs. A segment of the same size, left by a previous run,
+ is taken over in place, so that the readers that have it mapped carry on;
+ otherwise it is replaced.
+*/
+class Snapshot
+{
+    std::string     path;
+    char*           map;
+    size_t          map_size;
+    SnapshotHeader* header;
+    SnapshotRecord* records;
+    char*           names;
+    uint32_t        count;
+    uint32_t        names_used;
+    uint32_t        truncated;
+    std::unordered_map<std::string, uint32_t> name_offsets;
+
+    uint32_t intern(const std::string& name);
+
+public:
+    Snapshot(const std::string& path, uint32_t max_records);
+    ~Snapshot();
+
+    bool ready() const { return map != NULL; }
+
+    // Start writing a new snapshot; the readers wait until it is published
+    void begin();
+
+    // The record of the next process; NULL if there is no room left
+    SnapshotRecord* add(const std::string& name);
+
+    // Publish the snapshot
+    void publish(unsigned ncores);
+
+    uint32_t get_truncated() const { return truncated; }
+};
+
+#endif      // SNAPSHOT_H
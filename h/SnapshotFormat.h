@@ -0,0 +1,168 @@
+/*
+-----------------------------------------------------------------------------
+    SnapshotFormat
+    Layout of the shared-memory snapshot of the processes, and its reader
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef SNAPSHOT_FORMAT_H
+#define SNAPSHOT_FORMAT_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#define SNAPSHOT_MAGIC      0x504e5350      // "PSNP"
+#define SNAPSHOT_VERSION    1
+// Bytes of the name table per record
+#define SNAPSHOT_NAME_BYTES 16
+
+/*
+ The segment holds a header, max_records fixed-size records and a table of
+ the process names, each kept once (a record holds the offset of its name;
+ offset 0 is the empty name). Its size is fixed when it is created.
+ The snapshot is guarded by a sequence lock: the writer makes 'seq' odd
+ before it changes anything, and even again once done. A reader copies the
+ snapshot out and keeps it only if 'seq' was even and unchanged throughout;
+ otherwise it tries again. So, a reader never blocks the writer, and needs no
+ syscall (once the segment is mapped).
+ The rates are per second, over the last polling period; the cpu_usage is a
+ percentage of one core.
+*/
+struct SnapshotHeader
+{
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    header_size;
+    uint32_t    record_size;
+    uint32_t    max_records;
+    uint32_t    names_size;
+    uint64_t    seq;            // odd while being written
+    // the snapshot
+    uint64_t    cycle;          // 0 until the first one is published
+    uint64_t    time_ns;        // CLOCK_REALTIME, of its publication
+    uint32_t    count;
+    uint32_t    names_used;
+    uint32_t    truncated;      // processes left out, for lack of room
+    uint32_t    ncores;
+};
+
+struct SnapshotRecord
+{
+    int32_t     pid;
+    int32_t     ppid;
+    uint32_t    uid;
+    uint32_t    name;           // offset in the name table
+    uint64_t    starttime;      // clock ticks after boot; tells apart a recycled pid
+    float       cpu_usage;
+    uint32_t    num_threads;
+    int32_t     priority;
+    int32_t     nice;
+    uint64_t    memory_rss;
+    uint64_t    memory_swap;
+    uint64_t    memory_rss_anon;
+    uint64_t    memory_rss_file;
+    uint64_t    read_bytes;
+    uint64_t    write_bytes;
+    uint64_t    cpu_delay;      // nsec/sec
+    uint64_t    blkio_delay;    // nsec/sec
+    uint64_t    swapin_delay;   // nsec/sec
+    uint64_t    minor_faults;
+    uint64_t    major_faults;
+    uint64_t    voluntary_ctxt_switches;
+    uint64_t    involuntary_ctxt_switches;
+};
+
+inline size_t snapshot_size(uint32_t max_records)
+{
+    return sizeof(SnapshotHeader) + (size_t) max_records * sizeof(SnapshotRecord) +
+           (size_t) max_records * SNAPSHOT_NAME_BYTES;
+}
+
+
+// A consistent copy of the snapshot
+struct SnapshotCopy
+{
+    SnapshotHeader              header;
+    std::vector<SnapshotRecord> records;
+    std::vector<char>           names;
+
+    const char* name(const SnapshotRecord& record) const
+    { return record.name < names.size() ? &names[record.name] : ""; }
+};
+
+class SnapshotReader
+{
+    const char* map;
+    size_t      map_size;
+
+    const SnapshotHeader* header() const { return (const SnapshotHeader*) map; }
+
+public:
+    SnapshotReader() : map(NULL), map_size(0) {}
+    ~SnapshotReader() { if (map) munmap((void*) map, map_size); }
+
+    // Map the segment; false if it is not there, or of another layout
+    bool open(const char* path)
+    {
+        int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void* ptr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(SnapshotHeader))
+            ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (ptr == MAP_FAILED)
+            return false;
+        map = (const char*) ptr;
+        map_size = st.st_size;
+
+        const SnapshotHeader* h = header();
+        if (h->magic != SNAPSHOT_MAGIC || h->version != SNAPSHOT_VERSION ||
+            h->header_size != sizeof(SnapshotHeader) || h->record_size != sizeof(SnapshotRecord) ||
+            snapshot_size(h->max_records) > map_size) {
+            munmap((void*) map, map_size);
+            map = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    // Copy the latest snapshot; false if none is published yet, or it did not hold still
+    bool read(SnapshotCopy& copy, unsigned tries = 1000) const
+    {
+        if (map == NULL)
+            return false;
+        const SnapshotHeader* h = header();
+        const SnapshotRecord* records = (const SnapshotRecord*) (map + sizeof(SnapshotHeader));
+        const char* names = (const char*) (records + h->max_records);
+
+        for (unsigned i = 0; i < tries; i++) {
+            uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+            if (seq & 1) {
+                // the writer takes about a msec; let it finish
+                if (i % 64 == 63)
+                    usleep(100);
+                continue;
+            }
+            copy.header = *h;
+            uint32_t count = copy.header.count < h->max_records ? copy.header.count : h->max_records;
+            uint32_t used = copy.header.names_used < h->names_size ? copy.header.names_used : h->names_size;
+            copy.records.assign(records, records + count);
+            copy.names.assign(names, names + used);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq)
+                return copy.header.cycle != 0;
+        }
+        return false;
+    }
+};
+
+#endif      // SNAPSHOT_FORMAT_H
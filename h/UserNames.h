@@ -0,0 +1,42 @@
+/*
+-----------------------------------------------------------------------------
+    UserNames
+    Cache of the user names, by uid
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#ifndef USER_NAMES_H
+#define USER_NAMES_H
+
+#include <sys/types.h>
+#include <time.h>
+#include <string>
+#include <unordered_map>
+
+#define PASSWD_FILE     "/etc/passwd"
+
+/*
+ The names are read from /etc/passwd as a whole, and read again only when its
+ modification time changes (one stat(2) per refresh), rather than one
+ getpwuid(3) per process. The users of other sources (e.g. LDAP) are shown
+ by their uid.
+*/
+class UserNames
+{
+    std::unordered_map<uid_t, std::string> names;
+    timespec    mtime;
+    bool        loaded;
+
+public:
+    UserNames() : mtime(), loaded(false) {}
+
+    // Read the names again, if the file has changed since the last time
+    void refresh();
+
+    // The name of a user, or else its uid
+    std::string name(uid_t uid) const;
+};
+
+#endif      // USER_NAMES_H
@@ -5,19 +5,38 @@
 #include <sys/types.h>
 #include <linux/taskstats.h>
 
+#include "ProcFile.h"
+
 typedef enum {
+    NO_TASK         = -4,   // no such task (ESRCH)
+    TIMEOUT         = -3,   // no reply in time; the connection is kept
     CRITICAL_FAIL   = -2,
     FAIL            = -1,
     SUCCESS         =  0
 } nl_rc;
 
 namespace taskstat {
+    // Recovery events and failures of the netlink connection, so far
+    struct Counters {
+        OVLValue timeouts;      // requests without a reply in time (or past the deadline)
+        OVLValue stale;         // replies to earlier requests, dropped
+        OVLValue enobufs;       // overruns of the receive buffer, which was enlarged
+        OVLValue reconnects;    // connections re-established, after a failure
+    };
+
     nl_rc nl_init(void);
     void nl_fini(void);
     bool is_socket_alive();
+    // Connect again, unless the last attempt was too recent
+    nl_rc nl_reconnect(void);
+
+    // No request waits beyond this time (monotonic, nsec); 0 for none
+    void set_deadline(OVLValue deadline_ns);
 
     nl_rc nl_taskstats_info(pid_t, taskstats*);
 
+    const Counters& get_counters();
+
     void dump_ts(taskstats& ts);
 
 }
@@ -0,0 +1,99 @@
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ChangeFilter.h"
+
+using namespace std;
+
+
+ChangeFilter::ChangeFilter(double relative, double absolute, unsigned keyframe)
+    : relative(relative)
+    , absolute(absolute)
+    , keyframe(keyframe)
+    , cycle(0)
+    , suppressed(0)
+{
+}
+
+void ChangeFilter::next_cycle()
+{
+    cycle++;
+    suppressed = 0;
+    if (!is_keyframe())
+        return;
+    for (auto it = series.begin(); it != series.end(); ) {
+        if (cycle - it->second.seen > keyframe)
+            it = series.erase(it);
+        else
+            ++it;
+    }
+}
+
+bool ChangeFilter::changed(const string& names, const vector<double>& values,
+                           const vector<bool>& rank, const Series& last) const
+{
+    if (names != last.fields)
+        return true;
+    for (size_t i = 0; i < values.size(); i++) {
+        // the absolute deadband is in the units of the metrics, not of the ranks
+        double delta = fabs(values[i] - last.values[i]);
+        if (delta > relative * fabs(last.values[i]) && (rank[i] || delta > absolute))
+            return true;
+    }
+    return false;
+}
+
+bool ChangeFilter::pass(const string& line)
+{
+    // measurement,tags field=value,... (no timestamps)
+    size_t key_end = line.find(' ');
+    if (key_end == string::npos)
+        return true;
+
+    string names;
+    vector<double> values;
+    vector<bool> rank;
+    const char* pos = line.c_str() + key_end + 1;
+    while (*pos) {
+        const char* eq = strchr(pos, '=');
+        if (eq == NULL)
+            break;
+        names.append(pos, eq - pos);
+        names += ',';
+        rank.push_back(eq - pos > 5 && strncmp(eq - 5, "_rank", 5) == 0);
+        char* end;
+        values.push_back(strtod(eq + 1, &end));
+        pos = end;
+        while (*pos && *pos != ',')
+            pos++;
+        if (*pos == ',')
+            pos++;
+    }
+
+    Series& last = series[line.substr(0, key_end)];
+    bool emit = is_keyframe() || last.fields.empty() || changed(names, values, rank, last);
+    last.seen = cycle;
+    if (!emit) {
+        suppressed++;
+        return false;
+    }
+    last.fields.swap(names);
+    last.values.swap(values);
+    return true;
+}
+
+string ChangeFilter::filter(const string& lines)
+{
+    string out;
+    out.reserve(lines.size());
+    size_t start = 0, end;
+    while ((end = lines.find('\n', start)) != string::npos) {
+        string line = lines.substr(start, end - start);
+        if (pass(line))
+            out.append(line).append(1, '\n');
+        start = end + 1;
+    }
+    return out;
+}
@@ -0,0 +1,151 @@
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "Checkpoint.h"
+
+#define CHECKPOINT_MAGIC    0x50435350      // "PSCP"
+#define CHECKPOINT_VERSION  1
+#define BOOT_ID             "/proc/sys/kernel/random/boot_id"
+
+// Grow the file in steps, rather than on every new process
+#define CHECKPOINT_GROWTH   (64 * 1024)
+
+using namespace std;
+
+struct Checkpoint::Header
+{
+    uint32_t    magic;          // written last
+    uint32_t    version;
+    uint32_t    record_size;
+    uint32_t    count;
+    char        boot_id[40];
+    OVLValue    saved_ns;       // monotonic
+    OVLValue    cpu[8];         // user, nice, sys, idle, iowait, irq, softirq, stolen
+};
+
+
+Checkpoint::Checkpoint(const string& path)
+    : path(path)
+    , fd(-1)
+    , map(NULL)
+    , map_size(0)
+{
+    memset(boot_id, 0, sizeof boot_id);
+    ProcFileData boot(BOOT_ID, sizeof boot_id - 1);
+    if (boot.refresh())
+        strncpy(boot_id, boot.data(), strcspn(boot.data(), "\n"));
+
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        OvlError("open(%s) failed, errno %d: %s. No checkpoints will be kept",
+                 path.c_str(), errno, strerror(errno));
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(Header))
+        remap(st.st_size);
+}
+
+Checkpoint::~Checkpoint()
+{
+    if (map)
+        munmap(map, map_size);
+    if (fd >= 0)
+        close(fd);
+}
+
+bool Checkpoint::remap(size_t size)
+{
+    if (map) {
+        munmap(map, map_size);
+        map = NULL;
+    }
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        OvlError("mmap(%s) failed, errno %d: %s", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+    map = (char*) ptr;
+    map_size = size;
+    return true;
+}
+
+bool Checkpoint::save(const CpuUsage& cpu, const vector<PidCheckpoint>& records)
+{
+    if (fd < 0)
+        return false;
+
+    size_t size = sizeof(Header) + records.size() * sizeof(PidCheckpoint);
+    if (size > map_size) {
+        size = (size + CHECKPOINT_GROWTH - 1) / CHECKPOINT_GROWTH * CHECKPOINT_GROWTH;
+        if (ftruncate(fd, size) != 0) {
+            OvlError("ftruncate(%s) failed, errno %d: %s", path.c_str(), errno, strerror(errno));
+            return false;
+        }
+        if (!remap(size))
+            return false;
+    }
+
+    Header* header = (Header*) map;
+    header->magic = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (!records.empty())
+        memcpy(map + sizeof(Header), records.data(), records.size() * sizeof(PidCheckpoint));
+    header->version = CHECKPOINT_VERSION;
+    header->record_size = sizeof(PidCheckpoint);
+    header->count = records.size();
+    memcpy(header->boot_id, boot_id, sizeof boot_id);
+    header->saved_ns = monotonic_ns();
+    OVLValue totals[8] = { cpu.user, cpu.nice, cpu.sys, cpu.idle,
+                           cpu.iowait, cpu.irq, cpu.softirq, cpu.stolen };
+    memcpy(header->cpu, totals, sizeof totals);
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header->magic = CHECKPOINT_MAGIC;
+    return true;
+}
+
+bool Checkpoint::load(CpuUsage& cpu, vector<PidCheckpoint>& records)
+{
+    records.clear();
+    if (map == NULL)
+        return false;
+
+    const Header* header = (const Header*) map;
+    if (header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION ||
+        header->record_size != sizeof(PidCheckpoint) ||
+        sizeof(Header) + header->count * sizeof(PidCheckpoint) > map_size) {
+        OvlWarn("Checkpoint %s is not valid; starting afresh", path.c_str());
+        return false;
+    }
+    if (memcmp(header->boot_id, boot_id, sizeof boot_id) != 0) {
+        OvlInfo("Checkpoint %s is from a previous boot; starting afresh", path.c_str());
+        return false;
+    }
+    OVLValue now_ns = monotonic_ns();
+    if (header->saved_ns > now_ns || now_ns - header->saved_ns > CHECKPOINT_MAX_AGE * 1000000000ULL) {
+        OvlInfo("Checkpoint %s is too old; starting afresh", path.c_str());
+        return false;
+    }
+
+    cpu.user    = header->cpu[0];
+    cpu.nice    = header->cpu[1];
+    cpu.sys     = header->cpu[2];
+    cpu.idle    = header->cpu[3];
+    cpu.iowait  = header->cpu[4];
+    cpu.irq     = header->cpu[5];
+    cpu.softirq = header->cpu[6];
+    cpu.stolen  = header->cpu[7];
+
+    const PidCheckpoint* first = (const PidCheckpoint*) (map + sizeof(Header));
+    records.assign(first, first + header->count);
+    return true;
+}
@@ -95,14 +95,15 @@ static unsigned delta_total (const CpuUsage& curr, const CpuUsage& prev)
          + unsigned (curr.stolen  - prev.stolen);
 }
 
+// Alternate between data sets to compute deltas
+// (toggle is the current set, 1 - toggle is 'last time')
+static int toggle = 1;
+static CpuUsage cpu_usage[2];
+
 bool getCPU(unsigned* delta_jiffies)
 {
     static ProcFileData proc_stat(PROC_STAT);
 
-    // Alternate between data sets to compute deltas
-    // (toggle is the current set, 1 - toggle is 'last time')
-    static int toggle = 1;
-    static CpuUsage cpu_usage[2];
     toggle = 1 - toggle;
 
     if (! cpu_usage[toggle].fetch(proc_stat, CPU_NAME))
@@ -117,4 +118,12 @@ bool getCPU(unsigned* delta_jiffies)
 
 }
 
+const CpuUsage& lastCPU()
+{
+    return cpu_usage[toggle];
+}
 
+void setLastCPU(const CpuUsage& cpu)
+{
+    cpu_usage[toggle] = cpu;
+}
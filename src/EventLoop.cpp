@@ -0,0 +1,209 @@
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "EventLoop.h"
+
+using namespace std;
+
+#define EVENTS_PER_WAIT 64
+
+static epoll_event event_of(int fd, uint32_t events)
+{
+    epoll_event ev;
+    ev.events = events;
+    ev.data.u64 = 0;
+    ev.data.fd = fd;
+    return ev;
+}
+
+EventLoop::EventLoop()
+    : epoll_fd(-1)
+    , signal_fd(-1)
+    , running(false)
+{
+    sigemptyset(&signals);
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        (signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        OvlError("Failed to create the event loop, errno %d: %s", errno, strerror(errno));
+        return;
+    }
+    epoll_event ev = event_of(signal_fd, EPOLLIN);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev)) {
+        OvlError("epoll_ctl failed, errno %d: %s", errno, strerror(errno));
+        close(signal_fd);
+        signal_fd = -1;
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    for (const auto& it : timers)
+        close(it.first);
+    if (signal_fd >= 0)
+        close(signal_fd);
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+}
+
+bool EventLoop::add_signal(int sig, Handler handler)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, sig);
+    sigaddset(&signals, sig);
+    // blocked, so that it is only delivered through the signalfd
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) || signalfd(signal_fd, &signals, 0) < 0) {
+        OvlError("Failed to take signal %d, errno %d: %s", sig, errno, strerror(errno));
+        return false;
+    }
+    sig_handlers[sig] = handler;
+    return true;
+}
+
+int EventLoop::add_timer(TimerHandler handler)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    epoll_event ev = event_of(fd, EPOLLIN);
+    if (fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        OvlError("Failed to create a timer, errno %d: %s", errno, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    timers[fd] = handler;
+    return fd;
+}
+
+bool EventLoop::set_timer(int timer, OVLValue interval_ns, OVLValue delay_ns)
+{
+    itimerspec spec;
+    spec.it_interval.tv_sec = interval_ns / 1000000000;
+    spec.it_interval.tv_nsec = interval_ns % 1000000000;
+    if (interval_ns && delay_ns) {
+        spec.it_value.tv_sec = delay_ns / 1000000000;
+        spec.it_value.tv_nsec = delay_ns % 1000000000;
+    } else
+        spec.it_value = spec.it_interval;
+    if (timerfd_settime(timer, 0, &spec, NULL)) {
+        OvlError("Failed to set a timer, errno %d: %s", errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void EventLoop::add_source(PollFds poll_fds, Serve serve)
+{
+    sources.push_back({ poll_fds, serve, vector<pollfd>(), false });
+}
+
+// Bring the descriptors of the sources in the set up to date, changing only those whose
+// events did. A source that was served may have closed a descriptor and accepted another
+// with the same number, which epoll dropped along with the old one: all of its are put back
+void EventLoop::sync_sources()
+{
+    unordered_map<int, SourceFd> wanted;
+    always_ready.clear();
+    for (size_t i = 0; i < sources.size(); i++) {
+        Source& source = sources[i];
+        source.fds.clear();
+        source.poll_fds(source.fds);
+        for (const pollfd& pfd : source.fds) {
+            uint32_t events = uint32_t(pfd.events);
+            auto last = source_fds.find(pfd.fd);
+            if (!source.served && last != source_fds.end() &&
+                last->second.source == i && last->second.events == events) {
+                wanted[pfd.fd] = last->second;
+                if (!last->second.polled)
+                    always_ready.push_back(pfd.fd);
+                continue;
+            }
+            epoll_event ev = event_of(pfd.fd, events);
+            wanted[pfd.fd] = { i, events, true };
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, pfd.fd, &ev) == 0)
+                continue;
+            if (errno == ENOENT && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pfd.fd, &ev) == 0)
+                continue;
+            // a regular file, always ready as far as poll(2) goes
+            if (errno == EPERM) {
+                wanted[pfd.fd].polled = false;
+                always_ready.push_back(pfd.fd);
+            } else {
+                OvlWarn("epoll_ctl(%d) failed, errno %d: %s", pfd.fd, errno, strerror(errno));
+                wanted.erase(pfd.fd);
+            }
+        }
+        source.served = false;
+    }
+    for (const auto& it : source_fds)
+        if (wanted.count(it.first) == 0)
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it.first, NULL);
+    source_fds.swap(wanted);
+}
+
+void EventLoop::read_signals()
+{
+    signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof info) == sizeof info) {
+        auto it = sig_handlers.find(info.ssi_signo);
+        if (it != sig_handlers.end())
+            it->second();
+    }
+}
+
+void EventLoop::read_timer(int fd)
+{
+    uint64_t expirations;
+    if (read(fd, &expirations, sizeof expirations) == sizeof expirations && expirations)
+        timers[fd](expirations);
+}
+
+void EventLoop::run()
+{
+    epoll_event events[EVENTS_PER_WAIT];
+    running = true;
+    while (running) {
+        sync_sources();
+        int timeout = (tasks.empty() && always_ready.empty()) ? -1 : 0;
+        int n = epoll_wait(epoll_fd, events, EVENTS_PER_WAIT, timeout);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            OvlError("epoll_wait failed, errno %d: %s", errno, strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == signal_fd)
+                read_signals();
+            else if (timers.count(fd))
+                read_timer(fd);
+            else if (source_fds.count(fd))
+                for (pollfd& pfd : sources[source_fds[fd].source].fds)
+                    if (pfd.fd == fd)
+                        pfd.revents = events[i].events;
+        }
+        for (int fd : always_ready)
+            for (pollfd& pfd : sources[source_fds[fd].source].fds)
+                if (pfd.fd == fd)
+                    pfd.revents = pfd.events;
+        for (Source& source : sources)
+            for (const pollfd& pfd : source.fds)
+                if (pfd.revents) {
+                    source.serve(source.fds);
+                    source.served = true;
+                    break;
+                }
+
+        // the tasks posted so far; those that they post go after the next wait
+        deque<Handler> now;
+        now.swap(tasks);
+        for (Handler& task : now)
+            task();
+    }
+}
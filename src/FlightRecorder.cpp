@@ -0,0 +1,214 @@
+
+#include <errno.h>
+#include <time.h>
+
+#include "FlightRecorder.h"
+
+using namespace std;
+
+
+FlightRecorder::FlightRecorder(const string& path, size_t data_size)
+    : path(path)
+    , map(NULL)
+    , map_size(recorder_data_offset() + data_size)
+    , header(NULL)
+    , index(NULL)
+    , data(NULL)
+    , oldest_seq(1)
+    , since_keyframe(RECORDER_KEYFRAME)
+    , frame()
+{
+    // of another size, the frames cannot be carried on; start over
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && st.st_size != (off_t) map_size)
+        unlink(path.c_str());
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        OvlError("open(%s) failed, errno %d: %s. No history will be recorded",
+                 path.c_str(), errno, strerror(errno));
+        return;
+    }
+    void* ptr = MAP_FAILED;
+    if (ftruncate(fd, map_size) == 0)
+        ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+        OvlError("Failed to map %s, errno %d: %s. No history will be recorded",
+                 path.c_str(), errno, strerror(errno));
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return;
+
+    map = (char*) ptr;
+    header = (RecorderHeader*) map;
+    index = (RecorderIndex*) (map + sizeof(RecorderHeader));
+    data = map + recorder_data_offset();
+
+    if (header->magic == RECORDER_MAGIC && header->version == RECORDER_VERSION &&
+        header->header_size == sizeof(RecorderHeader) && header->index_size == RECORDER_INDEX &&
+        header->columns == REC_COLUMNS && header->data_size == data_size &&
+        header->head <= data_size) {
+        // carry on after the last frame
+        oldest_seq = header->seq + 1;
+        for (unsigned i = 0; i < RECORDER_INDEX; i++)
+            if (index[i].seq && index[i].seq < oldest_seq)
+                oldest_seq = index[i].seq;
+        return;
+    }
+
+    header->magic = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(index, 0, RECORDER_INDEX * sizeof(RecorderIndex));
+    header->version = RECORDER_VERSION;
+    header->header_size = sizeof(RecorderHeader);
+    header->index_size = RECORDER_INDEX;
+    header->columns = REC_COLUMNS;
+    header->pad = 0;
+    header->data_size = data_size;
+    header->seq = 0;
+    header->head = 0;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header->magic = RECORDER_MAGIC;
+}
+
+FlightRecorder::~FlightRecorder()
+{
+    if (map)
+        munmap(map, map_size);
+}
+
+void FlightRecorder::begin(unsigned ncores, uint64_t cpu_jiffies)
+{
+    rows.clear();
+    frame.ncores = ncores;
+    frame.cpu_jiffies = cpu_jiffies;
+}
+
+uint64_t* FlightRecorder::add(pid_t pid, const string& name)
+{
+    rows.push_back(Row());
+    Row& row = rows.back();
+    row.pid = pid;
+    row.name = name;
+    return row.values;
+}
+
+void FlightRecorder::encode()
+{
+    sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) { return a.pid < b.pid; });
+
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    frame.seq = header->seq + 1;
+    frame.time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    frame.count = rows.size();
+    frame.keyframe = (since_keyframe >= RECORDER_KEYFRAME);
+
+    // the names that are new, or changed since the previous frame
+    vector<const Row*> prev(rows.size());
+    vector<uint64_t> name_ids(rows.size());
+    unordered_map<string, uint64_t> table;
+    string names;
+    // both sorted by pid
+    auto p_it = frame.keyframe ? previous.end() : previous.begin();
+    for (size_t i = 0; i < rows.size(); i++) {
+        while (p_it != previous.end() && p_it->pid < rows[i].pid)
+            ++p_it;
+        prev[i] = (p_it != previous.end() && p_it->pid == rows[i].pid) ? &*p_it : NULL;
+        if (prev[i] && prev[i]->name == rows[i].name)
+            continue;
+        auto t_it = table.find(rows[i].name);
+        if (t_it == table.end()) {
+            t_it = table.insert(make_pair(rows[i].name, table.size() + 1)).first;
+            put_varint(names, rows[i].name.size());
+            names += rows[i].name;
+        }
+        name_ids[i] = t_it->second;
+    }
+
+    buff.assign(sizeof frame, 0);
+    put_varint(buff, table.size());
+    buff += names;
+    vector<uint64_t> column(rows.size());
+    pid_t pid = 0;
+    for (size_t i = 0; i < rows.size(); i++) {
+        column[i] = rows[i].pid - pid - 1;
+        pid = rows[i].pid;
+    }
+    put_column(buff, column);
+    put_column(buff, name_ids);
+    for (unsigned c = 0; c < REC_COLUMNS; c++) {
+        for (size_t i = 0; i < rows.size(); i++)
+            column[i] = zigzag(int64_t(rows[i].values[c] - (prev[i] ? prev[i]->values[c] : 0)));
+        put_column(buff, column);
+    }
+
+    frame.length = buff.size();
+    memcpy(&buff[0], &frame, sizeof frame);
+
+    previous.swap(rows);
+}
+
+// Drop from the index the oldest frames, as far as they are within the part of the ring
+// about to be overwritten
+void FlightRecorder::drop_overwritten(uint64_t start, uint64_t end)
+{
+    for (; oldest_seq <= header->seq; oldest_seq++) {
+        RecorderIndex& entry = index[oldest_seq % RECORDER_INDEX];
+        if (entry.seq != oldest_seq)
+            continue;
+        if (entry.offset >= end || entry.offset + entry.length <= start)
+            break;
+        __atomic_store_n(&entry.seq, 0, __ATOMIC_RELAXED);
+    }
+}
+
+void FlightRecorder::commit()
+{
+    if (!map)
+        return;
+    encode();
+
+    uint64_t length = buff.size();
+    if (length > header->data_size) {
+        OvlWarn("A frame of %llu bytes does not fit in %s", (OVLValue) length, path.c_str());
+        // the next one cannot depend on it
+        since_keyframe = RECORDER_KEYFRAME;
+        return;
+    }
+    since_keyframe = frame.keyframe ? 1 : since_keyframe + 1;
+
+    uint64_t seq = frame.seq;
+    uint64_t offset = header->head;
+    if (offset + length > header->data_size) {
+        drop_overwritten(offset, header->data_size);
+        offset = 0;
+    }
+    drop_overwritten(offset, offset + length);
+    // the index entry to be reused
+    if (seq >= RECORDER_INDEX && oldest_seq <= seq - RECORDER_INDEX)
+        oldest_seq = seq - RECORDER_INDEX + 1;
+    RecorderIndex& entry = index[seq % RECORDER_INDEX];
+    __atomic_store_n(&entry.seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(data + offset, buff.data(), length);
+    entry.time_ns = frame.time_ns;
+    entry.offset = offset;
+    entry.length = length;
+    entry.keyframe = frame.keyframe;
+    __atomic_store_n(&entry.seq, seq, __ATOMIC_RELEASE);
+    header->seq = seq;
+    header->head = offset + length;
+}
+
+uint64_t FlightRecorder::get_span_ns() const
+{
+    if (!map || !header->seq)
+        return 0;
+    const RecorderIndex& oldest = index[oldest_seq % RECORDER_INDEX];
+    const RecorderIndex& newest = index[header->seq % RECORDER_INDEX];
+    if (oldest.seq != oldest_seq || newest.seq != header->seq)
+        return 0;
+    return newest.time_ns - oldest.time_ns;
+}
@@ -0,0 +1,254 @@
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <algorithm>
+
+#include "MetricsServer.h"
+
+using namespace std;
+
+
+MetricsServer::MetricsServer(const string& address)
+    : address(address)
+    , listen_fd(-1)
+    , response(reply("503 Service Unavailable", "no cycle yet\n"))
+    , scrapes(0)
+{
+    bool ok = (address[0] == '/') ? listen_unix() : listen_tcp();
+    if (!ok && listen_fd >= 0) {
+        close(listen_fd);
+        listen_fd = -1;
+    }
+}
+
+MetricsServer::~MetricsServer()
+{
+    for (Client& client : clients)
+        disconnect(client);
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        if (!path.empty())
+            unlink(path.c_str());
+    }
+}
+
+bool MetricsServer::listen_unix()
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (address.size() >= sizeof addr.sun_path) {
+        OvlError("The metrics socket path is too long: %s", address.c_str());
+        return false;
+    }
+    strcpy(addr.sun_path, address.c_str());
+
+    // the socket of a previous run is in the way; anything else is a mistake
+    struct stat st;
+    if (lstat(address.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            OvlError("Not a socket: %s", address.c_str());
+            return false;
+        }
+        unlink(address.c_str());
+    }
+
+    // only for the owner, like the query socket: the metrics tell about all the processes
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(listen_fd, (sockaddr*) &addr, sizeof addr) ||
+        chmod(address.c_str(), S_IRUSR | S_IWUSR) ||
+        listen(listen_fd, METRICS_MAX_CLIENTS)) {
+        OvlError("Failed to listen on %s, errno %d: %s", address.c_str(), errno, strerror(errno));
+        unlink(address.c_str());
+        return false;
+    }
+    path = address;
+    return true;
+}
+
+bool MetricsServer::listen_tcp()
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    string host = "127.0.0.1";
+    string port = address;
+    size_t colon = address.rfind(':');
+    if (colon != string::npos) {
+        host = address.substr(0, colon);
+        port = address.substr(colon + 1);
+    }
+    if (host == "localhost")
+        host = "127.0.0.1";
+    char* end;
+    unsigned long num = strtoul(port.c_str(), &end, 10);
+    if (port.empty() || *end || num == 0 || num > 65535 ||
+        inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+        OvlError("Invalid metrics address (%s); expected a path, or [host:]port", address.c_str());
+        return false;
+    }
+    addr.sin_port = htons(num);
+
+    int on = 1;
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) ||
+        bind(listen_fd, (sockaddr*) &addr, sizeof addr) ||
+        listen(listen_fd, METRICS_MAX_CLIENTS)) {
+        OvlError("Failed to listen on %s, errno %d: %s", address.c_str(), errno, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+shared_ptr<const string> MetricsServer::reply(const char* status, const string& body)
+{
+    string head = string("HTTP/1.1 ") + status + "\r\n"
+        "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+        "Content-Length: " + to_string(body.size()) + "\r\n"
+        "Connection: close\r\n\r\n";
+    return make_shared<const string>(head + body);
+}
+
+void MetricsServer::publish(const string& body)
+{
+    response = reply("200 OK", body);
+}
+
+void MetricsServer::poll_fds(vector<pollfd>& fds) const
+{
+    if (listen_fd < 0)
+        return;
+    // the rest wait in the backlog
+    if (clients.size() < METRICS_MAX_CLIENTS)
+        fds.push_back({ listen_fd, POLLIN, 0 });
+    for (const Client& client : clients)
+        fds.push_back({ client.fd, short(client.out ? POLLOUT : POLLIN), 0 });
+}
+
+bool MetricsServer::serve(const vector<pollfd>& fds)
+{
+    bool any = false;
+    bool incoming = false;
+    for (const pollfd& pfd : fds) {
+        if (!pfd.revents)
+            continue;
+        any = true;
+        if (pfd.fd == listen_fd) {
+            incoming = true;
+            continue;
+        }
+        for (Client& client : clients) {
+            if (client.fd != pfd.fd)
+                continue;
+            bool ok = client.out ? send(client) : receive(client);
+            // one request per connection
+            if (!ok || (client.out && client.sent == client.out->size()))
+                disconnect(client);
+            break;
+        }
+    }
+
+    clients.erase(remove_if(clients.begin(), clients.end(),
+                            [](const Client& client) { return client.fd < 0; }),
+                  clients.end());
+    if (incoming)
+        accept_clients();
+    return any;
+}
+
+void MetricsServer::expire(OVLValue now_ns)
+{
+    for (Client& client : clients)
+        if (now_ns - client.accepted_ns >= OVLValue(METRICS_TIMEOUT_MS) * 1000000)
+            disconnect(client);
+    clients.erase(remove_if(clients.begin(), clients.end(),
+                            [](const Client& client) { return client.fd < 0; }),
+                  clients.end());
+}
+
+void MetricsServer::accept_clients()
+{
+    while (clients.size() < METRICS_MAX_CLIENTS) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                OvlWarn("accept failed, errno %d: %s", errno, strerror(errno));
+            return;
+        }
+        clients.push_back({ fd, string(), NULL, 0, monotonic_ns() });
+    }
+}
+
+// Read the request head and, once it is all there, pick the response; false to disconnect
+bool MetricsServer::receive(Client& client)
+{
+    char buff[2048];
+    while (1) {
+        ssize_t n = recv(client.fd, buff, sizeof buff, 0);
+        if (n == 0)
+            return false;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            break;
+        }
+        client.in.append(buff, n);
+        if (client.in.size() > METRICS_MAX_REQUEST)
+            return false;
+    }
+    if (client.in.find("\r\n\r\n") == string::npos && client.in.find("\n\n") == string::npos)
+        return true;
+
+    // GET <target> HTTP/1.x
+    size_t method_end = client.in.find(' ');
+    size_t target_end = client.in.find_first_of(" \r\n", method_end + 1);
+    string method = client.in.substr(0, method_end);
+    string target = (method_end == string::npos || target_end == string::npos) ? "" :
+                    client.in.substr(method_end + 1, target_end - method_end - 1);
+    target = target.substr(0, target.find('?'));
+
+    if (method != "GET")
+        client.out = reply("405 Method Not Allowed", "only GET\n");
+    else if (target != METRICS_PATH && target != "/")
+        client.out = reply("404 Not Found", "try " METRICS_PATH "\n");
+    else {
+        client.out = response;
+        scrapes++;
+    }
+    client.in.clear();
+    return send(client);
+}
+
+// Send as much of the response as the socket takes; false to disconnect
+bool MetricsServer::send(Client& client)
+{
+    const string& out = *client.out;
+    while (client.sent < out.size()) {
+        ssize_t n = ::send(client.fd, out.data() + client.sent, out.size() - client.sent,
+                           MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        client.sent += n;
+    }
+    return true;
+}
+
+void MetricsServer::disconnect(Client& client)
+{
+    if (client.fd >= 0)
+        close(client.fd);
+    client.fd = -1;
+    client.out.reset();
+}
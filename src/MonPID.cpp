@@ -1,12 +1,15 @@
 
+#include <errno.h>
 #include <string.h>
-#include <sstream>
 #include <string>
-#include <dirent.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <sys/resource.h>
 
 #include "MonPID.h"
 #include "taskstats.h"
+#include "ProcDir.h"
+#include "ProcBatch.h"
 
 #define PROC_STAT            "/proc/%u/stat"
 #define PROC_STAT_SIZE       sizeof(PROC_STAT) + 6
@@ -14,61 +17,344 @@
 #define PROC_STATUS          "/proc/%u/status"
 #define PROC_STATUS_SIZE     sizeof(PROC_STATUS) + 6
 
+#define PROC_SMAPS_ROLLUP    "/proc/%u/smaps_rollup"
+#define PROC_SMAPS_ROLLUP_SIZE  sizeof(PROC_SMAPS_ROLLUP) + 6
+
+#define PROC_CMDLINE         "/proc/%u/cmdline"
+#define PROC_CMDLINE_SIZE    sizeof(PROC_CMDLINE) + 6
+
 #define PROC_TASK            "/proc/%u/task"
 #define PROC_TASK_SIZE       sizeof(PROC_TASK) + 6
 
+#define PROC_TASK_STAT       "/proc/%u/task/%u/stat"
+#define PROC_TASK_STAT_SIZE  sizeof(PROC_TASK_STAT) + 12
+
 #define VMRSS   "VmRSS:"
+#define VMSWAP  "VmSwap:"
+#define RSSANON "RssAnon:"
+#define RSSFILE "RssFile:"
+#define UID     "Uid:"
+#define VOLUNTARY_CTXT      "voluntary_ctxt_switches:"
+#define NONVOLUNTARY_CTXT   "nonvoluntary_ctxt_switches:"
+#define PSS             "\nPss:"
+#define PRIVATE_CLEAN   "\nPrivate_Clean:"
+#define PRIVATE_DIRTY   "\nPrivate_Dirty:"
+
+// Descriptors left for everything else, when they are kept open for the processes
+#define FD_RESERVE      256
 
 using namespace std;
 
 
+struct ProcFiles
+{
+    char            stat_path[PROC_STAT_SIZE];
+    char            status_path[PROC_STATUS_SIZE];
+    ProcFileData    stat;
+    ProcFileData    status;
+    bool            keep_open;      // false, once out of descriptors
+
+    explicit ProcFiles(pid_t pid);
+    ~ProcFiles();
+
+    static unsigned open_files;
+    static unsigned max_open_files;
+    // the data of a process are parsed right away, so the read buffers are shared by all
+    static char stat_buffer[1024 + 1];
+    static char status_buffer[FILEBUFF + 1];
+};
+
+unsigned ProcFiles::open_files = 0;
+unsigned ProcFiles::max_open_files = 0;
+char ProcFiles::stat_buffer[1024 + 1];
+char ProcFiles::status_buffer[FILEBUFF + 1];
+
+ProcFiles::ProcFiles(pid_t pid)
+    : stat(stat_path, sizeof stat_buffer - 1, stat_buffer)
+    , status(status_path, sizeof status_buffer - 1, status_buffer)
+{
+    snprintf(stat_path, PROC_STAT_SIZE, PROC_STAT, unsigned(pid));
+    snprintf(status_path, PROC_STATUS_SIZE, PROC_STATUS, unsigned(pid));
+
+    // Two descriptors per process: raise the soft limit as far as allowed, the first time
+    if (max_open_files == 0) {
+        rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+            rl.rlim_cur = rl.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+                getrlimit(RLIMIT_NOFILE, &rl);
+            max_open_files = (rl.rlim_cur > 2 * FD_RESERVE) ? rl.rlim_cur - FD_RESERVE : FD_RESERVE;
+        } else
+            max_open_files = FD_RESERVE;
+    }
+    keep_open = (open_files + 2 <= max_open_files);
+    if (keep_open)
+        open_files += 2;
+}
+
+ProcFiles::~ProcFiles()
+{
+    if (keep_open)
+        open_files -= 2;
+}
+
+// Delta of a cumulative counter since its last value, which is then updated.
+// A counter that went backwards (i.e. it belongs to another task by now) gives no delta
+static inline OVLValue counter_delta(OVLValue new_value, OVLValue& last_value)
+{
+    OVLValue delta = (new_value >= last_value) ? new_value - last_value : 0;
+    last_value = new_value;
+    return delta;
+}
+
+// Rate per second of a delta over the given interval
+static inline OVLValue per_second(OVLValue delta, OVLValue interval_ns)
+{
+    return interval_ns ? OVLValue(delta * 1.0e9 / interval_ns + 0.5) : 0;
+}
+
+// Parse the space separated numeric fields that follow the ')' of the process name,
+// i.e. from field 3 (the state, which is not numeric and is stored as 0) onwards
+void parse_stat_fields(const char* cp, OVLValue fields[STAT_NFIELDS])
+{
+    char* end;
+    for (int n = 3; n < STAT_NFIELDS && *cp; n++) {
+        while (*cp == ' ')
+            cp++;
+        fields[n] = strtoull(cp, &end, 10);
+        // skip a non-numeric field
+        for (cp = end; *cp && *cp != ' '; cp++)
+            ;
+    }
+}
+
+
 MonPID::MonPID (pid_t pid_val)
     : pid (pid_val)
+    , ppid (0)
+    , starttime (0)
     , cpu_total(0)
     , cpu_delta(0)
+    , cchild_total(0)
+    , cchild_delta(0)
+    , cchild_discount(0)
     , vmRSS(0)
+    , vmSwap(0)
+    , rssAnon(0)
+    , rssFile(0)
+    , num_threads(0)
+    , uid(uid_t(-1))
+    , priority(0)
+    , nice(0)
+    , sample_ns (0)
+    , interval_ns (0)
+    , cycle_share (1)
+    , read_bytes(0)
+    , read_bytes_rate(0)
+    , write_bytes(0)
+    , write_bytes_rate(0)
+    , blkio_delay_total(0)
+    , blkio_delay_rate(0)
+    , swapin_delay_total(0)
+    , swapin_delay_rate(0)
+    , cpu_delay_total(0)
+    , cpu_delay_rate(0)
+    , minflt_total(0)
+    , minflt_rate(0)
+    , majflt_total(0)
+    , majflt_rate(0)
+    , nvcsw_total(0)
+    , nvcsw_rate(0)
+    , nivcsw_total(0)
+    , nivcsw_rate(0)
+    , rss_latest_ns(0)
+    , rss_samples(0)
+    , rss_next(0)
+    , rss_growth(0)
+    , pss(0)
+    , uss(0)
+    , pss_ns(0)
+    , pss_valid(false)
     , found (false)
+    , stale_cycles (0)
     , initial_sample(true)
+    , taskstat_epoch(taskstat_epochs)
+    , match(ProcMatcher::NONE)
+    , match_epoch(match_epochs)
+    , cmdline_checks(0)
+    , smoothed{}
+    , smoothed_primed(false)
 {
-    if (!skip_taskstat) {
-        if (!taskstat::is_socket_alive())
-            if (taskstat::nl_init() == CRITICAL_FAIL)
-                skip_taskstat = true;
-    }
-
     if (pid_val != 0)
         if(update())
             found = true;
 }
 
+MonPID::MonPID (const PidCheckpoint& cp)
+    : MonPID (pid_t(0))
+{
+    pid = cp.pid;
+    ppid = cp.ppid;
+    starttime = cp.starttime;
+    sample_ns = cp.sample_ns;
+    #define RESTORE(X)      X = cp.X;
+    RESTORE(cpu_total)
+    RESTORE(cchild_total)
+    RESTORE(minflt_total)
+    RESTORE(majflt_total)
+    RESTORE(nvcsw_total)
+    RESTORE(nivcsw_total)
+    RESTORE(read_bytes)
+    RESTORE(write_bytes)
+    RESTORE(blkio_delay_total)
+    RESTORE(swapin_delay_total)
+    RESTORE(cpu_delay_total)
+    #undef RESTORE
+    // the next update gives the deltas since the checkpoint (or starts over, for a recycled pid)
+    initial_sample = false;
+}
+
+void MonPID::checkpoint(PidCheckpoint& cp) const
+{
+    memset(&cp, 0, sizeof cp);
+    cp.pid = pid;
+    cp.ppid = ppid;
+    cp.starttime = starttime;
+    cp.sample_ns = sample_ns;
+    #define SAVE(X)         cp.X = X;
+    SAVE(cpu_total)
+    SAVE(cchild_total)
+    SAVE(minflt_total)
+    SAVE(majflt_total)
+    SAVE(nvcsw_total)
+    SAVE(nivcsw_total)
+    SAVE(read_bytes)
+    SAVE(write_bytes)
+    SAVE(blkio_delay_total)
+    SAVE(swapin_delay_total)
+    SAVE(cpu_delay_total)
+    #undef SAVE
+}
+
 bool MonPID::skip_taskstat = false;
+bool MonPID::taskstat_enabled = true;
+unsigned MonPID::taskstat_epochs = 0;
+bool MonPID::taskstat_lost = false;
+const ProcMatcher* MonPID::matcher = NULL;
+unsigned MonPID::match_epochs = 0;
+float MonPID::smoothing = 0;
+OVLValue MonPID::cycle_ns = 0;
+
+void MonPID::set_matcher(const ProcMatcher* rules)
+{
+    matcher = rules;
+    match_epochs++;
+}
+
+void MonPID::apply_rules()
+{
+    match_epoch = match_epochs;
+    ProcMatcher::Result last = ProcMatcher::Result(match);
+    if (matcher == NULL)
+        match = ProcMatcher::NONE;
+    else {
+        string cmdline;
+        if (matcher->needs_cmdline()) {
+            if (cmdline_checks < CMDLINE_RECHECKS)
+                cmdline_checks++;
+            char cmdline_name[PROC_CMDLINE_SIZE];
+            snprintf(cmdline_name, PROC_CMDLINE_SIZE, PROC_CMDLINE, unsigned(pid));
+            ProcFileData cmdlinefile(cmdline_name);
+            if (cmdlinefile.refresh()) {
+                // the arguments are separated by NULs
+                cmdline.assign(cmdlinefile.data(), cmdlinefile.length());
+                replace(cmdline.begin(), cmdline.end(), '\0', ' ');
+                cmdline.erase(cmdline.find_last_not_of(' ') + 1);
+            }
+        }
+        match = matcher->match(name, cmdline);
+    }
+
+    // the baselines of an excluded process have not been kept up to date
+    if (last == ProcMatcher::EXCLUDE && match != ProcMatcher::EXCLUDE)
+        initial_sample = true;
+}
+
+void MonPID::set_taskstats(bool on)
+{
+    if (on == taskstat_enabled)
+        return;
+    taskstat_enabled = on;
+    if (on) {
+        // give it another chance, even if it had failed before
+        skip_taskstat = false;
+        taskstat_epochs++;
+    } else {
+        skip_taskstat = true;
+        taskstat::nl_fini();
+    }
+}
+OVLValue MonPID::pid_reuses = 0;
+
+// Start over, as a newly found process
+void MonPID::reinit()
+{
+    name.clear();
+    initial_sample = true;
+    pss = uss = pss_ns = 0;
+    pss_valid = false;
+    smoothed_primed = false;
+    rss_samples = rss_next = 0;
+    rss_growth = 0;
+    cchild_discount = 0;
+    if (threads)
+        threads->clear();
+}
+
+bool MonPID::queue_reads(ProcBatch& batch)
+{
+    if (batch.room() < 2)
+        return false;
+    if (!files)
+        files = make_shared<ProcFiles>(pid);
+    batch.add(&files->stat);
+    if (match != ProcMatcher::EXCLUDE)
+        batch.add(&files->status);
+    return true;
+}
+
+void MonPID::discard_reads()
+{
+    if (files) {
+        files->stat.discard();
+        files->status.discard();
+    }
+}
 
 int MonPID::fetch_taskstats(pid_t pid, taskstats *ts) {
     char task_dir[PROC_TASK_SIZE];
+    static ProcDir taskdir;
+    static vector<pid_t> vTids;
 
     snprintf(task_dir, PROC_TASK_SIZE, PROC_TASK, unsigned(pid));
-    DIR *taskdir = opendir(task_dir);
-    if (taskdir == NULL) {
-        OvlError("Failed to open '%s (process: %s)', errno %d: %s",
-                 task_dir, name.c_str(),
-                 errno, strerror(errno));
-        return FAIL;
+    if (!taskdir.list(task_dir, vTids)) {
+        OvlDebug("Failed to list '%s (process: %s)'", task_dir, name.c_str());
+        return NO_TASK;
     }
 
-    // Read the directories in the task directory, which represent the thread IDs of that PID
+    // The entries of the task directory are the thread IDs of that PID
     // We are interested in the per-PID metrics, so we sum the per-TID metrics
-    struct dirent* entry;
-    char *endptr = NULL;
-    int rc;
-    while ((entry = readdir(taskdir)))
+    int rc = SUCCESS;
+    for (pid_t tid : vTids)
     {
-        pid_t tid = strtol(entry->d_name, &endptr, 10);
-        // Skip non-numeric entries
-        if (*endptr != '\0')
-            continue;
-
         taskstats temp_ts;
-        if ((rc = taskstat::nl_taskstats_info(tid, &temp_ts)) != SUCCESS)
+        rc = taskstat::nl_taskstats_info(tid, &temp_ts);
+        // a thread may have exited since the listing; only the main one tells that the process is gone
+        if (rc == NO_TASK && tid != pid) {
+            rc = SUCCESS;
+            continue;
+        }
+        if (rc != SUCCESS)
             break;
         #define MEMBR_ADD(X)    ts->X += temp_ts.X;
         MEMBR_ADD(read_bytes)
@@ -77,24 +363,147 @@ int MonPID::fetch_taskstats(pid_t pid, taskstats *ts) {
         MEMBR_ADD(cpu_delay_total)
         MEMBR_ADD(swapin_delay_total)
         #undef MEMBR_ADD
+
+        if (threads)
+            update_thread(tid, temp_ts);
     }
 
-    if (closedir(taskdir))
-        OvlError("Failed to close '%s' dir, errno %d: %s",
-                 task_dir, errno, strerror(errno));
+    // forget the threads that have exited; unless some were not reached, for a failure
+    if (threads && rc == SUCCESS) {
+        auto it = threads->begin();
+        while (it != threads->end()) {
+            if (!it->second.found)
+                it = threads->erase(it);
+            else {
+                it->second.found = false;
+                ++it;
+            }
+        }
+    }
     return rc;
 
 }
 
-bool MonPID::update ()
+// Update the usage of a thread, from its taskstats and its /proc/<pid>/task/<tid>/stat
+void MonPID::update_thread(pid_t tid, const taskstats& ts)
 {
-    char pps_name[PROC_STAT_SIZE];
+    char tstat_name[PROC_TASK_STAT_SIZE];
+    snprintf(tstat_name, PROC_TASK_STAT_SIZE, PROC_TASK_STAT, unsigned(pid), unsigned(tid));
+    ProcFileData tstatfile(tstat_name, 1024);
+    if (!tstatfile.refresh())
+        return;
+
+    const char* lp_pos = strchr(tstatfile.data(), '(');
+    const char* rp_pos = strrchr(tstatfile.data(), ')');
+    if (lp_pos == NULL || rp_pos == NULL)
+        return;
+    OVLValue fields[STAT_NFIELDS] = {0};
+    parse_stat_fields(rp_pos + 1, fields);
+    OVLValue cpu_now = fields[STAT_UTIME] + fields[STAT_STIME];
+
+    auto it = threads->find(tid);
+    if (it == threads->end()) {
+        ThreadStats& th = (*threads)[tid];
+        th.cpu_total            = cpu_now;
+        th.cpu_delay_total      = ts.cpu_delay_total;
+        th.blkio_delay_total    = ts.blkio_delay_total;
+        th.cpu_delta = th.cpu_delay_delta = th.blkio_delay_delta = 0;
+        th.primed = false;
+        it = threads->find(tid);
+    } else {
+        ThreadStats& th = it->second;
+        th.cpu_delta            = in_cycle(counter_delta(cpu_now, th.cpu_total));
+        th.cpu_delay_delta      = in_cycle(counter_delta(ts.cpu_delay_total, th.cpu_delay_total));
+        th.blkio_delay_delta    = in_cycle(counter_delta(ts.blkio_delay_total, th.blkio_delay_total));
+        th.primed = true;
+    }
+    // threads may rename themselves at any time
+    it->second.name.assign(lp_pos + 1, rp_pos - lp_pos - 1);
+    it->second.found = true;
+}
 
-    snprintf (pps_name, PROC_STAT_SIZE, PROC_STAT, unsigned (pid));
-    ProcFileData statfile (pps_name);
-    if (! statfile.refresh ())
+bool MonPID::update_pss()
+{
+    char smaps_name[PROC_SMAPS_ROLLUP_SIZE];
+    snprintf(smaps_name, PROC_SMAPS_ROLLUP_SIZE, PROC_SMAPS_ROLLUP, unsigned(pid));
+    ProcFileData smapsfile(smaps_name);
+    // a failed read (e.g. no ptrace access) is not retried before the next refresh either
+    pss_ns = monotonic_ns();
+    if (!(pss_valid = smapsfile.refresh()))
         return false;
 
+    // Convert from KiB to bytes
+    pss = smapsfile.get_value(PSS) << 10;
+    uss = (smapsfile.get_value(PRIVATE_CLEAN) + smapsfile.get_value(PRIVATE_DIRTY)) << 10;
+    return true;
+}
+
+void MonPID::set_thread_tracking(bool on)
+{
+    if (on && !threads && !skip_taskstat) {
+        threads = make_shared<mThreadStats>();
+        // take the baseline of the threads now, so that they have deltas at the next update
+        taskstats ts;
+        memset(&ts, 0, sizeof (taskstats));
+        if (taskstat::is_socket_alive())
+            fetch_taskstats(pid, &ts);
+    } else if (!on)
+        threads.reset();
+}
+
+// Pick the needed values out of /proc/<pid>/status, in a single pass over its lines
+void MonPID::parse_status(const char* data)
+{
+    #define MATCH(KEY)  (strncmp(cp, KEY, sizeof(KEY) - 1) == 0 && (cp += sizeof(KEY) - 1))
+    OVLValue nvcsw = 0, nivcsw = 0;
+    char* end;
+    for (const char* cp = data; cp && *cp; cp = strchr(cp, '\n'), cp = cp ? cp + 1 : NULL) {
+        // memory sizes are in KiB; convert them to bytes
+        if (*cp == 'V') {
+            if (MATCH(VMRSS))
+                vmRSS = strtoull(cp, &end, 10) << 10;
+            else if (MATCH(VMSWAP))
+                vmSwap = strtoull(cp, &end, 10) << 10;
+        } else if (*cp == 'R') {
+            if (MATCH(RSSANON))
+                rssAnon = strtoull(cp, &end, 10) << 10;
+            else if (MATCH(RSSFILE))
+                rssFile = strtoull(cp, &end, 10) << 10;
+        } else if (*cp == 'U') {
+            if (MATCH(UID))
+                uid = uid_t(strtoul(cp, &end, 10));
+        } else if (MATCH(VOLUNTARY_CTXT))
+            nvcsw = strtoull(cp, &end, 10);
+        else if (MATCH(NONVOLUNTARY_CTXT))
+            nivcsw = strtoull(cp, &end, 10);
+    }
+    #undef MATCH
+
+    if (initial_sample) {
+        nvcsw_total = nvcsw;
+        nivcsw_total = nivcsw;
+    }
+    nvcsw_rate = per_second(counter_delta(nvcsw, nvcsw_total), interval_ns);
+    nivcsw_rate = per_second(counter_delta(nivcsw, nivcsw_total), interval_ns);
+}
+
+bool MonPID::update ()
+{
+    if (!files)
+        files = make_shared<ProcFiles>(pid);
+    ProcFileData& statfile = files->stat;
+    bool was_open = statfile.is_open ();
+    if (! statfile.refresh ()) {
+        // A descriptor kept open reads ESRCH once its process is gone, even if the pid is
+        // in use again by now; open it anew, for the start time check below to tell
+        if (!was_open || statfile.error () != ESRCH)
+            return false;
+        files->status.close ();
+        if (! statfile.refresh ())
+            return false;
+    }
+    OVLValue now_ns = statfile.read_ns();
+
     // Get the process's name (the name between the parentheses)
     char* lp_pos = strchr (const_cast<char*>(statfile.data ()), '(');
     char* rp_pos = strrchr (const_cast<char*>(statfile.data ()), ')');
@@ -105,108 +514,246 @@ bool MonPID::update ()
         return false;
     }
 
-    if (name.empty ())
-        name = string (lp_pos + 1, rp_pos - lp_pos - 1);
+    // Parse the numeric fields, which follow the name
+    OVLValue fields[STAT_NFIELDS] = {0};
+    parse_stat_fields(rp_pos + 1, fields);
+
+    // A different start time means that the pid was recycled since the last cycle
+    if (!initial_sample && fields[STAT_STARTTIME] != starttime) {
+        OvlDebug("pid %u reused: '%s' is gone", unsigned(pid), name.c_str());
+        pid_reuses++;
+        reinit();
+    }
+    starttime = fields[STAT_STARTTIME];
+
+    // A new name (for the same process) means an exec
+    size_t name_len = rp_pos - lp_pos - 1;
+    bool renamed = (name.compare (0, string::npos, lp_pos + 1, name_len) != 0);
+    if (renamed) {
+        name.assign (lp_pos + 1, name_len);
+        cmdline_checks = 0;
+    }
+
+    // The include/exclude rules are matched on discovery, on an exec, or with new rules; and
+    // for the command line rules, at the first few updates as well
+    if (renamed || match_epoch != match_epochs ||
+        (cmdline_checks < CMDLINE_RECHECKS && matcher && matcher->needs_cmdline()))
+        apply_rules();
+
+    // All the rates of this update are over the time since the previous read
+    interval_ns = initial_sample ? 0 : now_ns - sample_ns;
+    sample_ns = now_ns;
+    // After a skip for the budget, the deltas span several cycles
+    cycle_share = (stale_cycles && cycle_ns && interval_ns > cycle_ns) ? double(cycle_ns) / interval_ns : 1;
 
     // We're updating, this entry is found
     found = true;
+    stale_cycles = 0;
 
-    // Make a string stream out of the statistics string
-    istringstream is (rp_pos + 1);
-
-    // Skip the next 12 (more) strings (status values)
-    string skip;
-    for (int n = 1; n < 12; ++n)
-        is >> skip;
+    ppid = pid_t(fields[STAT_PPID]);
+    num_threads = fields[STAT_NUM_THREADS];
+    // these two may be negative
+    priority = (long long)fields[STAT_PRIORITY];
+    nice = (long long)fields[STAT_NICE];
 
     // Read the user-land and kernel-space jiffies
-    OVLValue utime = 0;
-    OVLValue stime = 0;
-    is >> utime >> stime;
-    OVLValue new_total = utime + stime;
+    OVLValue new_total = fields[STAT_UTIME] + fields[STAT_STIME];
+    OVLValue new_cchild = fields[STAT_CUTIME] + fields[STAT_CSTIME];
 
     // Update cpu with the new latest data
-    if (initial_sample)
+    if (initial_sample) {
         cpu_total = new_total;
+        cchild_total = new_cchild;
+        minflt_total = fields[STAT_MINFLT];
+        majflt_total = fields[STAT_MAJFLT];
+    }
 
-    cpu_delta = new_total - cpu_total;
-    cpu_total = new_total;
+    cpu_delta = in_cycle(counter_delta(new_total, cpu_total));
+    cchild_delta = counter_delta(new_cchild, cchild_total);
+    cchild_delta = in_cycle((cchild_delta > cchild_discount) ? cchild_delta - cchild_discount : 0);
+    cchild_discount = 0;
+    minflt_rate = per_second(counter_delta(fields[STAT_MINFLT], minflt_total), interval_ns);
+    majflt_rate = per_second(counter_delta(fields[STAT_MAJFLT], majflt_total), interval_ns);
 
 
+    // Nothing more of an excluded process; just enough to notice its exit or exec
+    if (match == ProcMatcher::EXCLUDE) {
+        initial_sample = false;
+        return true;
+    }
+
     // Update the VM
-    char ppsus_name[PROC_STATUS_SIZE];
-    snprintf (ppsus_name, PROC_STATUS_SIZE, PROC_STATUS, unsigned (pid));
-    ProcFileData statusfile (ppsus_name);
-    if (statusfile.refresh ())
-    {
-        OVLValue new_data = statusfile.get_value (VMRSS);
-        // Convert from KiB to bytes
-        vmRSS = new_data << 10;
+    if (files->status.refresh ()) {
+        parse_status (files->status.data ());
+        track_rss (now_ns);
+    }
+
+    if (!files->keep_open) {
+        statfile.close();
+        files->status.close();
     }
 
-    // Update the I/O metrics, from taskstats
-    if (!skip_taskstat) {
-        int rc;
+    // Update the I/O metrics, from taskstats. A lost connection is not given up on: it is
+    // tried again every so often, and the I/O metrics are left out in the meantime
+    if (!skip_taskstat && !taskstat::is_socket_alive() &&
+        taskstat::nl_reconnect() == SUCCESS && taskstat_lost) {
+        // the totals went on while disconnected
+        taskstat_lost = false;
+        taskstat_epochs++;
+    }
+    int rc = CRITICAL_FAIL;
+    if (!skip_taskstat && taskstat::is_socket_alive()) {
         taskstats ts;
         memset(&ts, 0, sizeof (taskstats));
         if ((rc = fetch_taskstats(pid, &ts)) == CRITICAL_FAIL) {
-            OvlWarn("Taskstats fetch failed. Try to re-establish the netlink connection");
-            if ((rc = taskstat::nl_init()) == CRITICAL_FAIL) {
-                skip_taskstat = true;
-                OvlError("Something is wrong with the taskstats netlink connection. I/O metrics will be excluded");
-
-            } else if ((rc = fetch_taskstats(pid, &ts)) == CRITICAL_FAIL) {
-                skip_taskstat = true;
-                OvlError("Second attempt to reconnect to netlink failed. I/O metrics will be excluded");
-            }
+            OvlDebug("Taskstats fetch failed (process: %s); reconnecting", name.c_str());
+            taskstat_lost = true;
         }
         if (rc == SUCCESS) {
-            if (initial_sample) {
+            if (initial_sample || taskstat_epoch != taskstat_epochs) {
                 read_bytes          = ts.read_bytes;
                 write_bytes         = ts.write_bytes;
                 blkio_delay_total   = ts.blkio_delay_total;
                 swapin_delay_total  = ts.swapin_delay_total;
                 cpu_delay_total     = ts.cpu_delay_total;
+                taskstat_epoch      = taskstat_epochs;
 
             }
-            read_bytes_delta    = llabs(ts.read_bytes - read_bytes);
-            read_bytes          = ts.read_bytes;
-            write_bytes_delta   = llabs(ts.write_bytes - write_bytes);
-            write_bytes         = ts.write_bytes;
-            blkio_delay_delta   = llabs(ts.blkio_delay_total - blkio_delay_total);
-            blkio_delay_total   = ts.blkio_delay_total;
-            swapin_delay_delta  = llabs(ts.swapin_delay_total - swapin_delay_total);
-            swapin_delay_total  = ts.swapin_delay_total;
-            cpu_delay_delta     = llabs(ts.cpu_delay_total - cpu_delay_total);
-            cpu_delay_total     = ts.cpu_delay_total;
-        } else
+            #define RATE(TOTAL)     per_second(counter_delta(ts.TOTAL, TOTAL), interval_ns)
+            read_bytes_rate     = RATE(read_bytes);
+            write_bytes_rate    = RATE(write_bytes);
+            blkio_delay_rate    = RATE(blkio_delay_total);
+            swapin_delay_rate   = RATE(swapin_delay_total);
+            cpu_delay_rate      = RATE(cpu_delay_total);
+            #undef RATE
+        } else if (rc == NO_TASK)
+            // the process is gone
             return false;
     }
+    if (rc != SUCCESS) {
+        // no stale rates, once the taskstats are off, or did not answer (in time); the
+        // next reply only sets the baselines, since it covers more than one interval
+        read_bytes_rate = write_bytes_rate = blkio_delay_rate = swapin_delay_rate = cpu_delay_rate = 0;
+        taskstat_epoch = taskstat_epochs - 1;
+    }
+    smooth();
     initial_sample = false;
     return true;
 }
 
+OVLValue MonPID::get_raw(RankedMetric metric) const
+{
+    switch (metric) {
+        case RANK_CPU:                  return cpu_delta;
+        case RANK_RSS:                  return vmRSS;
+        case RANK_READ_BYTES:           return read_bytes_rate;
+        case RANK_WRITE_BYTES:          return write_bytes_rate;
+        case RANK_BLKIO_DELAY:          return blkio_delay_rate;
+        case RANK_SWAPIN_DELAY:         return swapin_delay_rate;
+        case RANK_CPU_DELAY:            return cpu_delay_rate;
+        case RANK_MAJOR_FAULTS:         return majflt_rate;
+        case RANK_INVOL_CTXT_SWITCHES:  return nivcsw_rate;
+        case RANK_RSS_GROWTH:           return rss_growth > 0 ? OVLValue(rss_growth) : 0;
+        default:                        return 0;
+    }
+}
+
+// Add a sample of the RSS to the ring, and take the least-squares slope of the ring. The times
+// are kept relative to the latest sample, so that they stay small enough for a float
+void MonPID::track_rss(OVLValue now_ns)
+{
+    float shift = rss_samples ? (now_ns - rss_latest_ns) / 1.0e9 : 0;
+    for (int i = 0; i < rss_samples; i++)
+        rss_times[i] -= shift;
+    rss_latest_ns = now_ns;
+    rss_times[rss_next] = 0;
+    rss_values[rss_next] = vmRSS;
+    rss_next = (rss_next + 1) % RSS_TREND_SAMPLES;
+    if (rss_samples < RSS_TREND_SAMPLES)
+        rss_samples++;
+
+    rss_growth = 0;
+    if (rss_samples < 3)
+        return;
+    double t_mean = 0, v_mean = 0;
+    for (int i = 0; i < rss_samples; i++) {
+        t_mean += rss_times[i];
+        v_mean += rss_values[i];
+    }
+    t_mean /= rss_samples;
+    v_mean /= rss_samples;
+    double stt = 0, stv = 0;
+    for (int i = 0; i < rss_samples; i++) {
+        double dt = rss_times[i] - t_mean;
+        stt += dt * dt;
+        stv += dt * (rss_values[i] - v_mean);
+    }
+    if (stt > 0)
+        rss_growth = stv / stt * 60;
+}
+
+// Update the moving averages, in O(1); they start from the first rates (not from 0), so that
+// a new process gets its place right away
+void MonPID::smooth()
+{
+    if (smoothing <= 0)
+        return;
+    for (int m = 0; m < RANKED_METRICS; m++) {
+        float raw = get_raw(RankedMetric(m));
+        smoothed[m] = smoothed_primed ? smoothed[m] + smoothing * (raw - smoothed[m]) : raw;
+    }
+    smoothed_primed = (interval_ns != 0);
+}
+
+MonPID MonPID::make_total(pid_t key)
+{
+    MonPID total;
+    total.pid = key;
+    total.initial_sample = false;
+    return total;
+}
+
 MonPID& MonPID::operator+=(const MonPID& right)
 {
     if (this == &right) return *this;
     if (name.empty()) name = right.name;
+    stale_cycles = max(stale_cycles, right.stale_cycles);
 
     #define MEMBR_ADD(X)    X  += right.X;
     MEMBR_ADD(cpu_total)
     MEMBR_ADD(cpu_delta)
+    MEMBR_ADD(cchild_total)
+    MEMBR_ADD(cchild_delta)
     MEMBR_ADD(vmRSS)
+    MEMBR_ADD(vmSwap)
+    MEMBR_ADD(rssAnon)
+    MEMBR_ADD(rssFile)
+    MEMBR_ADD(num_threads)
     MEMBR_ADD(read_bytes)
-    MEMBR_ADD(read_bytes_delta)
+    MEMBR_ADD(read_bytes_rate)
     MEMBR_ADD(write_bytes)
-    MEMBR_ADD(write_bytes_delta)
+    MEMBR_ADD(write_bytes_rate)
     MEMBR_ADD(blkio_delay_total)
-    MEMBR_ADD(blkio_delay_delta)
+    MEMBR_ADD(blkio_delay_rate)
     MEMBR_ADD(swapin_delay_total)
-    MEMBR_ADD(swapin_delay_delta)
+    MEMBR_ADD(swapin_delay_rate)
     MEMBR_ADD(cpu_delay_total)
-    MEMBR_ADD(cpu_delay_delta)
+    MEMBR_ADD(cpu_delay_rate)
+    MEMBR_ADD(minflt_total)
+    MEMBR_ADD(minflt_rate)
+    MEMBR_ADD(majflt_total)
+    MEMBR_ADD(majflt_rate)
+    MEMBR_ADD(nvcsw_total)
+    MEMBR_ADD(nvcsw_rate)
+    MEMBR_ADD(nivcsw_total)
+    MEMBR_ADD(nivcsw_rate)
+    MEMBR_ADD(rss_growth)
     #undef MEMBR_ADD
 
+    // the averages of a sum are the sums of the averages
+    for (int m = 0; m < RANKED_METRICS; m++)
+        smoothed[m] += right.smoothed[m];
+
     return *this;
 }
 
@@ -222,23 +769,35 @@ bool compare_by_RSS(const MonPID& a, const MonPID& b)
 }
 
 bool compare_by_IO_Read_Bytes(const MonPID& a, const MonPID& b) {
-    return a.read_bytes_delta > b.read_bytes_delta;
+    return a.read_bytes_rate > b.read_bytes_rate;
 }
 
 bool compare_by_IO_Write_Bytes(const MonPID& a, const MonPID& b) {
-    return a.write_bytes_delta > b.write_bytes_delta;
+    return a.write_bytes_rate > b.write_bytes_rate;
 }
 
 bool compare_by_cpu_delay(const MonPID& a, const MonPID& b) {
-    return a.cpu_delay_delta > b.cpu_delay_delta;
+    return a.cpu_delay_rate > b.cpu_delay_rate;
 }
 
 bool compare_by_blkio_delay(const MonPID& a, const MonPID& b) {
-    return a.blkio_delay_delta > b.blkio_delay_delta;
+    return a.blkio_delay_rate > b.blkio_delay_rate;
 }
 
 bool compare_by_swapin_delay(const MonPID& a, const MonPID& b) {
-    return a.swapin_delay_delta > b.swapin_delay_delta;
+    return a.swapin_delay_rate > b.swapin_delay_rate;
+}
+
+bool compare_by_major_faults(const MonPID& a, const MonPID& b) {
+    return a.majflt_rate > b.majflt_rate;
+}
+
+bool compare_by_invol_ctxt_switches(const MonPID& a, const MonPID& b) {
+    return a.nivcsw_rate > b.nivcsw_rate;
+}
+
+bool compare_by_RSS_growth(const MonPID& a, const MonPID& b) {
+    return a.rss_growth > b.rss_growth;
 }
 
 // Show the collected metrics
@@ -246,34 +805,42 @@ void MonPID::trace() const
 {
     OvlInfo("%s stats:\n\
 \t pid = %u\n\
+\t ppid = %u\n\
+\t starttime = %llu\n\
 \t cpu = %llu\n\
 \t cpu_delta = %llu\n\
+\t cchild = %llu\n\
+\t cchild_delta = %llu\n\
 \t VmRSS = %llu bytes\n\
 \t read_bytes = %lld bytes\n\
-\t read_bytes_delta = %lld bytes\n\
+\t read_bytes_rate = %lld bytes/s\n\
 \t write_bytes = %lld bytes\n\
-\t write_bytes_delta = %lld bytes\n\
+\t write_bytes_rate = %lld bytes/s\n\
 \t blkio_delay_total = %lld nanosec\n\
-\t blkio_delay_delta = %lld nanosec\n\
+\t blkio_delay_rate = %lld nanosec/s\n\
 \t swapin_delay_total = %lld nanosec\n\
-\t swapin_delay_delta = %lld nanosec\n\
+\t swapin_delay_rate = %lld nanosec/s\n\
 \t cpu_delay_total = %lld nanosec\n\
-\t cpu_delay_delta = %lld nanosec\n\
+\t cpu_delay_rate = %lld nanosec/s\n\
 \t found = %d\n",
         name.c_str(),
         pid,
+        ppid,
+        starttime,
         cpu_total,
         cpu_delta,
+        cchild_total,
+        cchild_delta,
         vmRSS,
         read_bytes,
-        read_bytes_delta,
+        read_bytes_rate,
         write_bytes,
-        write_bytes_delta,
+        write_bytes_rate,
         blkio_delay_total,
-        blkio_delay_delta,
+        blkio_delay_rate,
         swapin_delay_total,
-        swapin_delay_delta,
+        swapin_delay_rate,
         cpu_delay_total,
-        cpu_delay_delta,
+        cpu_delay_rate,
         found);
 }
@@ -0,0 +1,119 @@
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "OutputQueue.h"
+
+using namespace std;
+
+
+OutputQueue::OutputQueue(int fd)
+    : fd(fd)
+    , written(0)
+    , limit(16)
+    , drop_newest(false)
+    , dropped(0)
+    , stall_ns(0)
+    , stall_start(0)
+{
+    flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        OvlWarn("Failed to make the output non-blocking, errno %d: %s", errno, strerror(errno));
+}
+
+OutputQueue::~OutputQueue()
+{
+    // the last cycles, if the consumer takes them soon enough; then the descriptor
+    // is restored, as it may be shared with others (e.g. a terminal)
+    drain(1000);
+    if (flags >= 0)
+        fcntl(fd, F_SETFL, flags);
+}
+
+void OutputQueue::set_limit(size_t batches, bool newest)
+{
+    limit = batches ? batches : 1;
+    drop_newest = newest;
+}
+
+void OutputQueue::push(string batch)
+{
+    if (batch.empty())
+        return;
+    // the front batch, once started, is never dropped
+    size_t droppable = batches.size() - (written ? 1 : 0);
+    if (batches.size() >= limit && droppable) {
+        dropped++;
+        if (drop_newest) {
+            write_out();
+            return;
+        }
+        batches.erase(batches.begin() + (written ? 1 : 0));
+    }
+    batches.push_back(move(batch));
+    write_out();
+}
+
+void OutputQueue::write_out()
+{
+    while (!batches.empty()) {
+        const string& batch = batches.front();
+        ssize_t n = write(fd, batch.data() + written, batch.size() - written);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!stall_start)
+                    stall_start = monotonic_ns();
+            } else {
+                OvlError("Failed to write the output, errno %d: %s", errno, strerror(errno));
+                batches.clear();
+                written = 0;
+            }
+            break;
+        }
+        written += n;
+        if (written == batch.size()) {
+            batches.pop_front();
+            written = 0;
+        }
+    }
+    if (batches.empty() && stall_start) {
+        stall_ns += monotonic_ns() - stall_start;
+        stall_start = 0;
+    }
+}
+
+void OutputQueue::poll_fds(vector<pollfd>& fds) const
+{
+    if (!batches.empty())
+        fds.push_back({ fd, POLLOUT, 0 });
+}
+
+bool OutputQueue::serve(const vector<pollfd>& fds)
+{
+    for (const pollfd& pfd : fds) {
+        if (pfd.fd != fd || !pfd.revents)
+            continue;
+        write_out();
+        return true;
+    }
+    return false;
+}
+
+void OutputQueue::drain(unsigned timeout_ms)
+{
+    OVLValue deadline_ns = monotonic_ns() + OVLValue(timeout_ms) * 1000000;
+    write_out();
+    while (!batches.empty()) {
+        OVLValue now_ns = monotonic_ns();
+        if (now_ns >= deadline_ns)
+            break;
+        pollfd pfd = { fd, POLLOUT, 0 };
+        if (poll(&pfd, 1, (deadline_ns - now_ns) / 1000000 + 1) < 0 && errno != EINTR)
+            break;
+        write_out();
+    }
+}
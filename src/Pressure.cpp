@@ -0,0 +1,78 @@
+
+#include <string.h>
+#include <stdlib.h>
+
+#include "Pressure.h"
+
+using namespace std;
+
+
+Pressure::Resource::Resource(const char* name)
+    : name(name)
+    , file(path, 256)
+    , available(true)
+    , primed(false)
+    , stall()
+{
+    snprintf(path, sizeof path, PROC_PRESSURE "%s", name);
+}
+
+
+Pressure::Pressure()
+{
+    resources[CPU] = new Resource("cpu");
+    resources[IO] = new Resource("io");
+    resources[MEMORY] = new Resource("memory");
+}
+
+Pressure::~Pressure()
+{
+    for (Resource* res : resources)
+        delete res;
+}
+
+void Pressure::parse(const char* line, Stall& stall, bool primed)
+{
+    const char* cp;
+    if ((cp = strstr(line, "avg10=")) != NULL)
+        stall.avg10 = strtof(cp + 6, NULL);
+    if ((cp = strstr(line, "avg60=")) != NULL)
+        stall.avg60 = strtof(cp + 6, NULL);
+    if ((cp = strstr(line, "total=")) != NULL) {
+        OVLValue total = strtoull(cp + 6, NULL, 10);
+        stall.total_delta = (primed && total >= stall.total) ? total - stall.total : 0;
+        stall.total = total;
+    }
+}
+
+bool Pressure::refresh()
+{
+    bool any = false;
+    for (Resource* res : resources) {
+        if (!res->available)
+            continue;
+        // once it fails, there is no PSI for this resource (until a restart)
+        if (!(res->available = res->file.refresh())) {
+            OvlWarn("No pressure information for %s", res->name);
+            continue;
+        }
+
+        const char* data = res->file.data();
+        const char* full = strstr(data, "\nfull ");
+        parse(data, res->stall[SOME], res->primed);
+        if (full)
+            parse(full + 1, res->stall[FULL], res->primed);
+        res->primed = true;
+        any = true;
+    }
+    return any;
+}
+
+float Pressure::max_some_avg10() const
+{
+    float avg10 = 0;
+    for (const Resource* res : resources)
+        if (res->available && res->stall[SOME].avg10 > avg10)
+            avg10 = res->stall[SOME].avg10;
+    return avg10;
+}
@@ -0,0 +1,183 @@
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "ProcBatch.h"
+
+// The workers of the kernel that do the reads, which block in procfs
+#define IOWQ_MAX_WORKERS    4
+
+
+static inline int io_uring_setup(unsigned entries, io_uring_params* p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+ProcBatch::ProcBatch()
+    : ring_fd(-1)
+    , sq()
+    , cq()
+    , sqes((io_uring_sqe*) MAP_FAILED)
+    , sqes_size(0)
+    , cqes(NULL)
+    , fixed(false)
+    , arena((char*) MAP_FAILED)
+    , queued(0)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof params);
+    if ((ring_fd = io_uring_setup(BATCH_SLOTS, &params)) < 0) {
+        OvlWarn("io_uring_setup failed, errno %d: %s. The /proc files will be read one by one",
+                errno, strerror(errno));
+        return;
+    }
+
+    // The rings are mapped together with a single mmap, since 5.4
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        OvlWarn("io_uring is too old. The /proc files will be read one by one");
+        teardown();
+        return;
+    }
+    sq.size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq.size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sq.size = cq.size = (sq.size > cq.size) ? sq.size : cq.size;
+    sq.ptr = mmap(NULL, sq.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_fd, IORING_OFF_SQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*) mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                ring_fd, IORING_OFF_SQES);
+    arena = (char*) mmap(NULL, BATCH_SLOTS * BATCH_SLOT_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (sq.ptr == MAP_FAILED || sqes == MAP_FAILED || arena == MAP_FAILED) {
+        OvlError("io_uring mmap failed, errno %d: %s", errno, strerror(errno));
+        teardown();
+        return;
+    }
+
+    char* base = (char*) sq.ptr;
+    sq.head = (unsigned*) (base + params.sq_off.head);
+    sq.tail = (unsigned*) (base + params.sq_off.tail);
+    sq.mask = *(unsigned*) (base + params.sq_off.ring_mask);
+    sq.array = (unsigned*) (base + params.sq_off.array);
+    cq.head = (unsigned*) (base + params.cq_off.head);
+    cq.tail = (unsigned*) (base + params.cq_off.tail);
+    cq.mask = *(unsigned*) (base + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*) (base + params.cq_off.cqes);
+
+    // Pin the slots once, rather than on every read; plain reads will do otherwise (e.g. RLIMIT_MEMLOCK)
+    iovec iov = { arena, BATCH_SLOTS * BATCH_SLOT_SIZE };
+    fixed = (io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+    if (!fixed) {
+        OvlDebug("io_uring buffers not registered, errno %d: %s", errno, strerror(errno));
+    }
+
+    // Not a thread per read of the batch; this one is not fatal either (it is since 5.15)
+    unsigned workers[2] = { IOWQ_MAX_WORKERS, IOWQ_MAX_WORKERS };
+    io_uring_register(ring_fd, IORING_REGISTER_IOWQ_MAX_WORKERS, workers, 2);
+}
+
+ProcBatch::~ProcBatch()
+{
+    teardown();
+}
+
+void ProcBatch::teardown()
+{
+    if (arena != MAP_FAILED)
+        munmap(arena, BATCH_SLOTS * BATCH_SLOT_SIZE);
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if (sq.ptr != NULL && sq.ptr != MAP_FAILED)
+        munmap(sq.ptr, sq.size);
+    if (ring_fd >= 0)
+        close(ring_fd);
+
+    arena = (char*) MAP_FAILED;
+    sqes = (io_uring_sqe*) MAP_FAILED;
+    sq.ptr = NULL;
+    ring_fd = -1;
+}
+
+bool ProcBatch::add(ProcFileData* file)
+{
+    if (!ready() || queued == BATCH_SLOTS)
+        return false;
+    int fd = file->open();
+    if (fd < 0)
+        return false;
+
+    // The SQ ring is only written by us; its entries map 1:1 to the slots
+    unsigned tail = *sq.tail;
+    unsigned index = tail & sq.mask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = 0;
+    sqe->addr = (unsigned long) (arena + queued * BATCH_SLOT_SIZE);
+    sqe->len = (file->size() < BATCH_SLOT_SIZE) ? file->size() : BATCH_SLOT_SIZE;
+    sqe->buf_index = 0;
+    sqe->user_data = queued;
+    sq.array[index] = index;
+    __atomic_store_n(sq.tail, tail + 1, __ATOMIC_RELEASE);
+
+    files[queued++] = file;
+    return true;
+}
+
+void ProcBatch::run()
+{
+    unsigned to_submit = queued;
+    unsigned pending = queued;
+
+    while (pending > 0) {
+        int rc = io_uring_enter(ring_fd, to_submit, pending, IORING_ENTER_GETEVENTS);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            // the files not handed over will just be read by their refresh()
+            OvlError("io_uring_enter failed, errno %d: %s", errno, strerror(errno));
+            break;
+        }
+        n_enters++;
+        to_submit -= (unsigned) rc < to_submit ? (unsigned) rc : to_submit;
+
+        // Consume whatever has completed so far
+        OVLValue now_ns = monotonic_ns();
+        unsigned head = *cq.head;
+        unsigned tail = __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const io_uring_cqe& cqe = cqes[head & cq.mask];
+            unsigned slot = (unsigned) cqe.user_data;
+            files[slot]->fill(arena + slot * BATCH_SLOT_SIZE, cqe.res, now_ns);
+            pending--;
+            n_reads++;
+        }
+        __atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+    }
+
+    if (pending > 0) {
+        // Give up on this ring; its stray completions would land in reused slots
+        OvlWarn("io_uring batch abandoned. The /proc files will be read one by one");
+        // the reads handed over are in the slots, which go away with the ring
+        for (unsigned slot = 0; slot < queued; slot++)
+            files[slot]->discard();
+        teardown();
+    }
+    queued = 0;
+}
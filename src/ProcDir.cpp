@@ -0,0 +1,97 @@
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <algorithm>
+
+#include "ProcDir.h"
+#include "ProcFile.h"
+
+using namespace std;
+
+// As returned by getdents64(2); glibc only declares it since 2.30
+struct linux_dirent64
+{
+    uint64_t        d_ino;
+    int64_t         d_off;
+    unsigned short  d_reclen;
+    unsigned char   d_type;
+    char            d_name[];
+};
+
+
+ProcDir::ProcDir(size_t size)
+    : m_size(size)
+{
+    m_buffer = new char[size];
+}
+
+ProcDir::~ProcDir()
+{
+    delete [] m_buffer;
+}
+
+bool ProcDir::list(const char* path, vector<pid_t>& pids)
+{
+    pids.clear();
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        // the task directory of a process that has just ended
+        OvlDebug("open(%s) failed, errno %d: %s", path, errno, strerror(errno));
+        return false;
+    }
+
+    long nread;
+    while ((nread = syscall(SYS_getdents64, fd, m_buffer, m_size)) > 0) {
+        for (long pos = 0; pos < nread; ) {
+            const linux_dirent64* entry = (const linux_dirent64*)(m_buffer + pos);
+            pos += entry->d_reclen;
+
+            // Skip non-numeric entries (and '.', '..')
+            const char* cp = entry->d_name;
+            if (*cp < '1' || *cp > '9')
+                continue;
+            pid_t pid = 0;
+            for (; *cp >= '0' && *cp <= '9'; cp++)
+                pid = pid * 10 + (*cp - '0');
+            if (*cp == '\0')
+                pids.push_back(pid);
+        }
+    }
+
+    bool ok = (nread == 0);
+    if (!ok)
+        OvlError("getdents64(%s) failed, errno %d: %s", path, errno, strerror(errno));
+    close(fd);
+
+    // /proc lists them in order already; don't count on it though
+    if (!is_sorted(pids.begin(), pids.end()))
+        sort(pids.begin(), pids.end());
+    return ok;
+}
+
+void ProcDir::diff(const vector<pid_t>& prev, const vector<pid_t>& curr,
+                   vector<pid_t>& added, vector<pid_t>& gone)
+{
+    added.clear();
+    gone.clear();
+
+    auto p_it = prev.begin(), c_it = curr.begin();
+    while (p_it != prev.end() && c_it != curr.end()) {
+        if (*p_it < *c_it)
+            gone.push_back(*p_it++);
+        else if (*c_it < *p_it)
+            added.push_back(*c_it++);
+        else {
+            ++p_it;
+            ++c_it;
+        }
+    }
+    gone.insert(gone.end(), p_it, prev.end());
+    added.insert(added.end(), c_it, curr.end());
+}
@@ -6,25 +6,36 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 
 #include "ProcFile.h"
 
-// Construct the item: save parameters and allocate the buffer
-ProcFileData::ProcFileData (const char path[], size_t size)
+using std::min;
+
+// Construct the item: save parameters and allocate the buffer, unless given one
+ProcFileData::ProcFileData (const char path[], size_t size, char* buffer)
 : m_size (size)
 , m_fd (-1)
 , m_length (-1)
-, m_data (NULL)
+, m_errno (0)
+, m_data (buffer)
+, m_owned (buffer == NULL)
+, m_read_ns (0)
+, m_filled (false)
+, m_ahead (NULL)
+, m_ahead_length (0)
 {
     m_path = (path) ? (char*)path : (char*)"/proc/stat";
-    m_data = new char[size + 1];
+    if (m_owned)
+        m_data = new char[size + 1];
 }
 
 // Destroy the item: close the file and release the buffer
 ProcFileData::~ProcFileData ()
 {
     this->close ();
-    delete [] m_data;
+    if (m_owned)
+        delete [] m_data;
 }
 
 // Force the file closed so it must be reopened on the next access
@@ -35,50 +46,85 @@ void ProcFileData::close ()
     m_fd = -1;
 }
 
-// Refresh the data by reading/re-reading the file into m_data
-bool ProcFileData::refresh ()
+// Open the file, if it isn't open already
+int ProcFileData::open ()
 {
-    // If the file isn't open, open it
     if (m_fd < 0)
     {
-        m_fd = open (m_path, O_RDONLY, 0);
+        m_fd = ::open (m_path, O_RDONLY, 0);
         if (m_fd < 0)
         {
+            m_errno = errno;
             // Some very short-lived processes are normal to have ended
             // by the time of their processing
             OvlDebug("open(%s) failed, errno %d: %s",
                       m_path, errno, strerror (errno));
-            return false;
         }
     }
-    // Otherwise rewind the file to read again
-    else
+    return m_fd;
+}
+
+// Refresh the data by reading/re-reading the file into m_data
+bool ProcFileData::refresh ()
+{
+    // The data have been read ahead already
+    if (m_filled)
     {
-        if (lseek (m_fd, 0L, SEEK_SET) == -1)
-        {
-            OvlError ("lseek(%s) failed, errno %d: %s",
-                      m_path, errno, strerror (errno));
-            return false;
-        }
+        m_filled = false;
+        m_length = m_ahead_length;
+        memcpy (m_data, m_ahead, m_length);
+        m_data[m_length] = 0;
+        return true;
     }
 
-    // Clear the buffer then read the file
-    memset (m_data, 0, m_size);
-    m_length = (int) read (m_fd, m_data, m_size);
+    if (this->open () < 0)
+        return false;
+
+    // Read from the start; there is no need to rewind the file first
+    m_length = (int) pread (m_fd, m_data, m_size, 0);
 
     // If the read fails, close the file
     if (m_length == -1)
     {
-        OvlError ("read(%s) failed, errno %d: %s",
-                  m_path, errno, strerror (errno));
+        m_errno = errno;
+        // ESRCH: the process has ended since its file was opened
+        if (m_errno == ESRCH)
+            OvlDebug ("read(%s) failed, errno %d: %s",
+                      m_path, m_errno, strerror (m_errno));
+        else
+            OvlError ("read(%s) failed, errno %d: %s",
+                      m_path, m_errno, strerror (m_errno));
         this->close ();
         return false;
     }
 
-    m_data[m_length+1] = 0;
+    m_data[m_length] = 0;
+    m_errno = 0;
+    m_read_ns = monotonic_ns ();
     return true;
 }
 
+// Keep the contents read by somebody else (a negative length is the errno of a failed read)
+void ProcFileData::fill (const char* data, int length, OVLValue read_ns)
+{
+    if (length < 0)
+    {
+        m_errno = -length;
+        OvlDebug ("read(%s) failed, errno %d: %s",
+                  m_path, -length, strerror (-length));
+        // leave it to refresh() to retry, and report it
+        this->close ();
+        m_filled = false;
+        return;
+    }
+
+    // copied by the next refresh(), since the buffer may be shared
+    m_ahead = data;
+    m_ahead_length = min (length, (int) m_size);
+    m_read_ns = read_ns;
+    m_filled = true;
+}
+
 // Search the data for 'name' and return 0 if it's not found;
 // otherwise return the string that _follows_ 'name' in the data
 const char* ProcFileData::data_after (const char* name) const
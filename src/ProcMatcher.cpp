@@ -0,0 +1,134 @@
+
+#include <string.h>
+#include <stdexcept>
+
+#include "ProcMatcher.h"
+
+using namespace std;
+
+
+// Anchored, since a glob is about the whole string
+string ProcMatcher::glob_to_regex(const string& glob)
+{
+    string re("^");
+    for (size_t i = 0; i < glob.size(); i++) {
+        char c = glob[i];
+        switch (c) {
+        case '*':
+            re += ".*";
+            break;
+        case '?':
+            re += '.';
+            break;
+        case '[': {
+            // a bracket expression is passed through as it is, apart from its negation;
+            // a ']' right after the opening (or the negation) is one of its members
+            bool negated = (i + 1 < glob.size() && glob[i + 1] == '!');
+            size_t first = i + (negated ? 2 : 1);
+            size_t end = glob.find(']', (first < glob.size() && glob[first] == ']') ? first + 1 : first);
+            if (end == string::npos) {
+                // not closed: a plain '['
+                re += "\\[";
+                break;
+            }
+            re += negated ? "[^" : "[";
+            re.append(glob, first, end - first + 1);
+            i = end;
+            break;
+        }
+        case '.': case '^': case '$': case '+': case '(': case ')':
+        case '{': case '}': case '|': case '\\':
+            re += '\\';
+            re += c;
+            break;
+        default:
+            re += c;
+        }
+    }
+    return re + "$";
+}
+
+ProcMatcher::~ProcMatcher()
+{
+    for (RuleSet& set : sets)
+        if (set.compiled)
+            regfree(&set.regex);
+}
+
+void ProcMatcher::add(const string& rule, bool exclude)
+{
+    string str(rule);
+    bool cmdline = (str.compare(0, strlen(RULE_CMDLINE), RULE_CMDLINE) == 0);
+    if (cmdline)
+        str.erase(0, strlen(RULE_CMDLINE));
+    RuleSet& set = sets[exclude ? (cmdline ? EXCLUDE_CMDLINE : EXCLUDE_NAME)
+                                : (cmdline ? INCLUDE_CMDLINE : INCLUDE_NAME)];
+
+    string pattern;
+    if (str.compare(0, strlen(RULE_REGEX), RULE_REGEX) == 0)
+        pattern = str.substr(strlen(RULE_REGEX));
+    else if (str.find_first_of("*?[") != string::npos)
+        pattern = glob_to_regex(str);
+    else {
+        set.names.insert(str);
+        return;
+    }
+
+    // Check it on its own, to tell which rule is wrong
+    regex_t regex;
+    int rc = regcomp(&regex, pattern.c_str(), REG_EXTENDED | REG_NOSUB);
+    if (rc != 0) {
+        char msg[128];
+        regerror(rc, &regex, msg, sizeof msg);
+        throw invalid_argument("rule '" + rule + "': " + msg);
+    }
+    regfree(&regex);
+    set.patterns.push_back(pattern);
+}
+
+void ProcMatcher::compile()
+{
+    for (RuleSet& set : sets) {
+        if (set.compiled) {
+            regfree(&set.regex);
+            set.compiled = false;
+        }
+        if (set.patterns.empty())
+            continue;
+
+        string combined;
+        for (const string& pattern : set.patterns)
+            combined += (combined.empty() ? "(" : "|(") + pattern + ")";
+        int rc = regcomp(&set.regex, combined.c_str(), REG_EXTENDED | REG_NOSUB);
+        if (rc != 0) {
+            char msg[128];
+            regerror(rc, &set.regex, msg, sizeof msg);
+            throw invalid_argument(string("rules '") + combined + "': " + msg);
+        }
+        set.compiled = true;
+    }
+}
+
+bool ProcMatcher::needs_cmdline() const
+{
+    for (int n : { INCLUDE_CMDLINE, EXCLUDE_CMDLINE })
+        if (!sets[n].names.empty() || !sets[n].patterns.empty())
+            return true;
+    return false;
+}
+
+bool ProcMatcher::RuleSet::match(const string& str) const
+{
+    if (names.count(str))
+        return true;
+    return compiled && regexec(&regex, str.c_str(), 0, NULL, 0) == 0;
+}
+
+ProcMatcher::Result ProcMatcher::match(const string& name, const string& cmdline) const
+{
+    if (sets[EXCLUDE_NAME].match(name) || sets[EXCLUDE_CMDLINE].match(cmdline))
+        return EXCLUDE;
+    if (sets[INCLUDE_NAME].match(name) || sets[INCLUDE_CMDLINE].match(cmdline))
+        return INCLUDE;
+    return NONE;
+}
@@ -0,0 +1,68 @@
+
+#include "ProcTree.h"
+
+using namespace std;
+
+
+void ProcTree::unlink(pid_t pid, pid_t ppid)
+{
+    auto it = children.find(ppid);
+    if (it == children.end())
+        return;
+    it->second.erase(pid);
+    if (it->second.empty())
+        children.erase(it);
+}
+
+void ProcTree::update(pid_t pid, pid_t ppid)
+{
+    auto it = parents.find(pid);
+    if (it != parents.end()) {
+        if (it->second == ppid)
+            return;
+        // re-parented (e.g. orphaned and adopted by init or a sub-reaper)
+        unlink(pid, it->second);
+        it->second = ppid;
+    } else
+        parents.insert(make_pair(pid, ppid));
+
+    children[ppid].insert(pid);
+}
+
+void ProcTree::remove(pid_t pid)
+{
+    auto it = parents.find(pid);
+    if (it == parents.end())
+        return;
+    unlink(pid, it->second);
+    parents.erase(it);
+    // The children of 'pid' keep pointing to it, until the kernel re-parents
+    // them and the next scan reports their new parent
+}
+
+pid_t ProcTree::get_parent(pid_t pid) const
+{
+    auto it = parents.find(pid);
+    return (it == parents.end()) ? 0 : it->second;
+}
+
+vector<pid_t> ProcTree::at_depth(unsigned depth) const
+{
+    vector<pid_t> level, next;
+
+    // the top of the tree is hanging from the (non-existent) pid 0
+    auto it = children.find(0);
+    if (it != children.end())
+        level.assign(it->second.begin(), it->second.end());
+
+    for (unsigned d = 0; d < depth && !level.empty(); d++) {
+        next.clear();
+        for (pid_t pid : level) {
+            auto c_it = children.find(pid);
+            if (c_it != children.end())
+                next.insert(next.end(), c_it->second.begin(), c_it->second.end());
+        }
+        level.swap(next);
+    }
+    return level;
+}
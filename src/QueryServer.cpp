@@ -0,0 +1,210 @@
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sstream>
+#include <algorithm>
+
+#include "QueryServer.h"
+
+using namespace std;
+
+
+QueryServer::QueryServer(const string& path, Handler handler)
+    : path(path)
+    , listen_fd(-1)
+    , handler(handler)
+    , requests(0)
+    , dropped(0)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof addr.sun_path) {
+        OvlError("The query socket path is too long: %s", path.c_str());
+        return;
+    }
+    strcpy(addr.sun_path, path.c_str());
+
+    // the socket of a previous run is in the way; anything else is a mistake
+    struct stat st;
+    if (lstat(path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            OvlError("Not a socket: %s", path.c_str());
+            return;
+        }
+        unlink(path.c_str());
+    }
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+        OvlError("socket failed, errno %d: %s", errno, strerror(errno));
+        return;
+    }
+    if (bind(listen_fd, (sockaddr*) &addr, sizeof addr) ||
+        chmod(path.c_str(), S_IRUSR | S_IWUSR) ||
+        listen(listen_fd, QUERY_MAX_CLIENTS)) {
+        OvlError("Failed to listen on %s, errno %d: %s", path.c_str(), errno, strerror(errno));
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(path.c_str());
+    }
+}
+
+QueryServer::~QueryServer()
+{
+    for (Client& client : clients)
+        disconnect(client);
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(path.c_str());
+    }
+}
+
+void QueryServer::poll_fds(vector<pollfd>& fds) const
+{
+    if (listen_fd < 0)
+        return;
+    // the rest wait in the backlog
+    if (clients.size() < QUERY_MAX_CLIENTS)
+        fds.push_back({ listen_fd, POLLIN, 0 });
+    for (const Client& client : clients)
+        fds.push_back({ client.fd, short((client.eof ? 0 : POLLIN) | (client.out.empty() ? 0 : POLLOUT)), 0 });
+}
+
+bool QueryServer::serve(const vector<pollfd>& fds)
+{
+    bool any = false;
+    bool incoming = false;
+    for (const pollfd& pfd : fds) {
+        if (!pfd.revents)
+            continue;
+        any = true;
+        if (pfd.fd == listen_fd) {
+            incoming = true;
+            continue;
+        }
+        for (Client& client : clients) {
+            if (client.fd != pfd.fd)
+                continue;
+            // reading may queue up responses, which are sent right away
+            if (!client.eof && (pfd.revents & (POLLIN | POLLHUP | POLLERR)) && !receive(client))
+                disconnect(client);
+            else if (!send(client) || (client.eof && client.out.empty()))
+                disconnect(client);
+            break;
+        }
+    }
+
+    clients.erase(remove_if(clients.begin(), clients.end(),
+                            [](const Client& client) { return client.fd < 0; }),
+                  clients.end());
+    if (incoming)
+        accept_clients();
+    return any;
+}
+
+void QueryServer::expire(OVLValue now_ns)
+{
+    for (Client& client : clients)
+        if (now_ns - client.active_ns >= OVLValue(QUERY_IDLE_MS) * 1000000) {
+            disconnect(client);
+            dropped++;
+        }
+    clients.erase(remove_if(clients.begin(), clients.end(),
+                            [](const Client& client) { return client.fd < 0; }),
+                  clients.end());
+}
+
+void QueryServer::accept_clients()
+{
+    while (clients.size() < QUERY_MAX_CLIENTS) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                OvlWarn("accept failed, errno %d: %s", errno, strerror(errno));
+            return;
+        }
+        clients.push_back({ fd, string(), string(), false, monotonic_ns() });
+    }
+}
+
+// Read what is there and serve the complete requests; false to disconnect
+bool QueryServer::receive(Client& client)
+{
+    char buff[4096];
+    while (1) {
+        ssize_t n = recv(client.fd, buff, sizeof buff, 0);
+        if (n == 0) {
+            // no more requests, but the responses still go out
+            client.eof = true;
+            break;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            break;
+        }
+        client.in.append(buff, n);
+    }
+
+    size_t start = 0, end;
+    while ((end = client.in.find('\n', start)) != string::npos) {
+        string request = client.in.substr(start, end - start);
+        start = end + 1;
+        if (!request.empty() && request.back() == '\r')
+            request.pop_back();
+        if (request.empty())
+            continue;
+
+        ostringstream response;
+        handler(request, response);
+        response << '\n';
+        client.out += response.str();
+        client.active_ns = monotonic_ns();
+        requests++;
+        if (client.out.size() > QUERY_MAX_PENDING) {
+            dropped++;
+            return false;
+        }
+    }
+    client.in.erase(0, start);
+    if (client.in.size() > QUERY_MAX_REQUEST) {
+        dropped++;
+        return false;
+    }
+    return true;
+}
+
+// Send as much of the responses as the socket takes; false to disconnect
+bool QueryServer::send(Client& client)
+{
+    size_t sent = 0;
+    while (sent < client.out.size()) {
+        ssize_t n = ::send(client.fd, client.out.data() + sent, client.out.size() - sent,
+                           MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            break;
+        }
+        sent += n;
+    }
+    if (sent)
+        client.active_ns = monotonic_ns();
+    client.out.erase(0, sent);
+    return true;
+}
+
+void QueryServer::disconnect(Client& client)
+{
+    if (client.fd >= 0)
+        close(client.fd);
+    client.fd = -1;
+}
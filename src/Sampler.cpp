@@ -0,0 +1,167 @@
+
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <unordered_set>
+
+#include "Sampler.h"
+#include "MonPID.h"
+
+#define PROC_STAT       "/proc/%u/stat"
+#define PROC_IO         "/proc/%u/io"
+
+#define READ_BYTES      "\nread_bytes:"
+#define WRITE_BYTES     "\nwrite_bytes:"
+
+using namespace std;
+
+
+Sampler::Ring::Ring(pid_t pid)
+    : stat(stat_path, 1024)
+    , io(io_path, 512)
+    , starttime(0)
+    , last_ns(0)
+    , primed(false)
+    , io_readable(true)
+    , head(0)
+    , count(0)
+{
+    snprintf(stat_path, sizeof stat_path, PROC_STAT, unsigned(pid));
+    snprintf(io_path, sizeof io_path, PROC_IO, unsigned(pid));
+}
+
+// Read the counters and push their rates since the previous sample.
+// Return false if the process is gone (or its pid has been recycled)
+bool Sampler::Ring::sample(double ticks_per_sec)
+{
+    if (!stat.refresh())
+        return false;
+    OVLValue now_ns = monotonic_ns();
+
+    const char* rp_pos = strrchr(stat.data(), ')');
+    if (rp_pos == NULL)
+        return false;
+    OVLValue fields[STAT_NFIELDS] = {0};
+    parse_stat_fields(rp_pos + 1, fields);
+
+    if (primed && fields[STAT_STARTTIME] != starttime)
+        return false;
+    starttime = fields[STAT_STARTTIME];
+
+    OVLValue now[NMETRICS];
+    now[CPU] = fields[STAT_UTIME] + fields[STAT_STIME];
+    // /proc/<pid>/io may not be readable (ptrace access mode); then there are just no I/O rates
+    if (io_readable && (io_readable = io.refresh())) {
+        now[READ] = io.get_value(READ_BYTES);
+        now[WRITE] = io.get_value(WRITE_BYTES);
+    } else
+        now[READ] = now[WRITE] = 0;
+
+    if (primed && now_ns > last_ns) {
+        double seconds = (now_ns - last_ns) / 1.0e9;
+        for (int m = 0; m < NMETRICS; m++) {
+            double delta = (now[m] >= last[m]) ? now[m] - last[m] : 0;
+            samples[m][head] = delta / seconds;
+        }
+        // CPU in percent (of one core), like cpu_usage
+        samples[CPU][head] *= 100 / ticks_per_sec;
+
+        head = (head + 1) % SAMPLE_RING;
+        if (count < SAMPLE_RING)
+            count++;
+    }
+
+    copy(now, now + NMETRICS, last);
+    last_ns = now_ns;
+    primed = true;
+    return true;
+}
+
+
+Sampler::Sampler()
+{
+    ticks_per_sec = sysconf(_SC_CLK_TCK);
+    if (ticks_per_sec <= 0)
+        ticks_per_sec = 100;
+}
+
+Sampler::~Sampler()
+{
+    for (auto& it : rings)
+        delete it.second;
+}
+
+void Sampler::set_candidates(const vector<pid_t>& pids)
+{
+    unordered_set<pid_t> sPids(pids.begin(), pids.end());
+
+    auto it = rings.begin();
+    while (it != rings.end()) {
+        if (sPids.count(it->first) == 0) {
+            delete it->second;
+            it = rings.erase(it);
+        } else
+            ++it;
+    }
+
+    for (pid_t pid : sPids)
+        if (rings.find(pid) == rings.end())
+            rings[pid] = new Ring(pid);
+}
+
+void Sampler::sample()
+{
+    OVLValue start_ns = monotonic_ns();
+
+    auto it = rings.begin();
+    while (it != rings.end()) {
+        if (!it->second->sample(ticks_per_sec)) {
+            delete it->second;
+            it = rings.erase(it);
+        } else {
+            n_samples++;
+            ++it;
+        }
+    }
+
+    time_ns += monotonic_ns() - start_ns;
+}
+
+SampleStats Sampler::stats(const float* samples, unsigned count)
+{
+    float sorted[SAMPLE_RING] = {0};
+    copy(samples, samples + count, sorted);
+
+    // nearest-rank 95th percentile
+    unsigned rank = (95 * count + 99) / 100;
+    nth_element(sorted, sorted + rank - 1, sorted + count);
+
+    SampleStats st;
+    st.p95 = sorted[rank - 1];
+    st.max = *max_element(sorted, sorted + count);
+    st.avg = 0;
+    for (unsigned i = 0; i < count; i++)
+        st.avg += sorted[i];
+    st.avg /= count;
+    return st;
+}
+
+bool Sampler::summary(pid_t pid, SampleStats& cpu, SampleStats& read, SampleStats& write) const
+{
+    auto it = rings.find(pid);
+    if (it == rings.end() || it->second->count == 0)
+        return false;
+
+    // the order of the samples does not matter; only the filled part of the ring
+    const Ring& ring = *it->second;
+    cpu = stats(ring.samples[CPU], ring.count);
+    read = stats(ring.samples[READ], ring.count);
+    write = stats(ring.samples[WRITE], ring.count);
+    return true;
+}
+
+void Sampler::reset()
+{
+    for (auto& it : rings)
+        it.second->head = it.second->count = 0;
+}
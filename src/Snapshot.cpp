@@ -0,0 +1,126 @@
+
+#include <errno.h>
+
+#include "Snapshot.h"
+
+using namespace std;
+
+
+Snapshot::Snapshot(const string& path, uint32_t max_records)
+    : path(path)
+    , map(NULL)
+    , map_size(snapshot_size(max_records))
+    , header(NULL)
+    , records(NULL)
+    , names(NULL)
+    , count(0)
+    , names_used(1)
+    , truncated(0)
+{
+    // of another size, the readers could not tell; start over
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && st.st_size != (off_t) map_size)
+        unlink(path.c_str());
+
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        OvlError("open(%s) failed, errno %d: %s. No snapshots will be published",
+                 path.c_str(), errno, strerror(errno));
+        return;
+    }
+    void* ptr = MAP_FAILED;
+    if (ftruncate(fd, map_size) == 0)
+        ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+        OvlError("Failed to map %s, errno %d: %s. No snapshots will be published",
+                 path.c_str(), errno, strerror(errno));
+    close(fd);
+    if (ptr == MAP_FAILED)
+        return;
+
+    map = (char*) ptr;
+    header = (SnapshotHeader*) map;
+    records = (SnapshotRecord*) (map + sizeof(SnapshotHeader));
+    names = (char*) (records + max_records);
+
+    // an empty snapshot, keeping the sequence of a previous run going
+    uint64_t seq = (header->magic == SNAPSHOT_MAGIC) ? header->seq & ~1ULL : 0;
+    __atomic_store_n(&header->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    header->magic = SNAPSHOT_MAGIC;
+    header->version = SNAPSHOT_VERSION;
+    header->header_size = sizeof(SnapshotHeader);
+    header->record_size = sizeof(SnapshotRecord);
+    header->max_records = max_records;
+    header->names_size = max_records * SNAPSHOT_NAME_BYTES;
+    header->cycle = 0;
+    header->time_ns = 0;
+    header->count = 0;
+    header->names_used = 1;
+    header->truncated = 0;
+    header->ncores = 0;
+    names[0] = 0;
+    __atomic_store_n(&header->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+Snapshot::~Snapshot()
+{
+    if (map)
+        munmap(map, map_size);
+}
+
+void Snapshot::begin()
+{
+    if (!map)
+        return;
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    count = 0;
+    names_used = 1;
+    truncated = 0;
+    name_offsets.clear();
+}
+
+uint32_t Snapshot::intern(const string& name)
+{
+    auto it = name_offsets.find(name);
+    if (it != name_offsets.end())
+        return it->second;
+    // out of room, the rest are nameless
+    if (names_used + name.size() + 1 > header->names_size)
+        return 0;
+    uint32_t offset = names_used;
+    memcpy(names + offset, name.c_str(), name.size() + 1);
+    names_used += name.size() + 1;
+    name_offsets.insert(make_pair(name, offset));
+    return offset;
+}
+
+SnapshotRecord* Snapshot::add(const string& name)
+{
+    if (!map)
+        return NULL;
+    if (count == header->max_records) {
+        truncated++;
+        return NULL;
+    }
+    SnapshotRecord* record = &records[count++];
+    memset(record, 0, sizeof *record);
+    record->name = intern(name);
+    return record;
+}
+
+void Snapshot::publish(unsigned ncores)
+{
+    if (!map)
+        return;
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    header->cycle++;
+    header->time_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    header->count = count;
+    header->names_used = names_used;
+    header->truncated = truncated;
+    header->ncores = ncores;
+    __atomic_store_n(&header->seq, header->seq + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,61 @@
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "UserNames.h"
+#include "ProcFile.h"
+
+using namespace std;
+
+
+void UserNames::refresh()
+{
+    struct stat st;
+    if (stat(PASSWD_FILE, &st) != 0) {
+        if (loaded)
+            OvlWarn("stat(%s) failed, errno %d: %s", PASSWD_FILE, errno, strerror(errno));
+        loaded = false;
+        return;
+    }
+    if (loaded && st.st_mtim.tv_sec == mtime.tv_sec && st.st_mtim.tv_nsec == mtime.tv_nsec)
+        return;
+
+    FILE* file = fopen(PASSWD_FILE, "r");
+    if (file == NULL) {
+        OvlError("fopen(%s) failed, errno %d: %s", PASSWD_FILE, errno, strerror(errno));
+        return;
+    }
+
+    // name:password:uid:gid:gecos:home:shell
+    names.clear();
+    char line[1024];
+    while (fgets(line, sizeof line, file)) {
+        char* colon = strchr(line, ':');
+        if (colon == NULL)
+            continue;
+        char* uid_pos = strchr(colon + 1, ':');
+        if (uid_pos == NULL)
+            continue;
+        char* end;
+        unsigned long uid = strtoul(uid_pos + 1, &end, 10);
+        if (end == uid_pos + 1 || *end != ':')
+            continue;
+        // the first entry of a uid wins, as with getpwuid()
+        names.insert(make_pair(uid_t(uid), string(line, colon - line)));
+    }
+    fclose(file);
+
+    mtime = st.st_mtim;
+    loaded = true;
+}
+
+string UserNames::name(uid_t uid) const
+{
+    auto it = names.find(uid);
+    if (it != names.end())
+        return it->second;
+    return to_string(uid);
+}
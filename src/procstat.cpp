@@ -8,11 +8,11 @@
 */
 
 #include <sys/types.h>
-#include <dirent.h>
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <poll.h>
 #include <iostream>
 #include <sstream>
 #include <unistd.h>
@@ -20,77 +20,289 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
-#include <chrono>
+#include <stdexcept>
 
 #include "MonPID.h"
 #include "CpuUsage.h"
+#include "ProcTree.h"
+#include "Sampler.h"
+#include "ProcDir.h"
+#include "ProcBatch.h"
+#include "Checkpoint.h"
+#include "ProcMatcher.h"
+#include "UserNames.h"
+#include "Pressure.h"
+#include "QueryServer.h"
+#include "Snapshot.h"
+#include "FlightRecorder.h"
+#include "MetricsServer.h"
+#include "ChangeFilter.h"
+#include "OutputQueue.h"
+#include "EventLoop.h"
+#include "taskstats.h"
 
 #define K 1000
 #define M (K*K)
 
 using namespace std;
 
-static volatile sig_atomic_t newPoll = 0;
-
 template<typename T> using pComparator = bool (*)(const T&, const T&);
 
-namespace {
-    // Sort a vector, according to the comparator function and return the first N entries
-    template <typename T>
-    vector<T> sort(vector<T>& t, pComparator<T> pC, ushort N=5)
+// The settings, as given by the environment and the configuration file
+struct Settings {
+
+    typedef unordered_set<string> strSet;
+
+    shared_ptr<ProcMatcher> matcher;    // the include/exclude rules; NULL for none
+    strSet sRollupRoots;
+    ushort bucket_size = 5;
+    bool aggregate = false;
+    bool rollup = false;
+    bool users = false;
+    unsigned rollupDepth = 1;
+    unsigned sampleInterval = 0;    // msec; 0 to disable the sampling
+    ushort sampleTopN = 0;          // 0 for the bucket size
+    ushort threadTopM = 0;          // top threads per top process; 0 to disable
+    bool pss = false;
+    unsigned pssRefresh = 60;       // sec
+    unsigned pssBudget = 20;        // msec per cycle
+    unsigned maxCycleMs = 0;        // time budget of a scan; 0 for none
+    float maxCPU = 0;               // CPU budget of a scan (% of the polling period); 0 for none
+    bool ioUring = false;
+    string stateFile;               // empty for no checkpoints
+    bool taskstats = true;
+    bool pressure = false;
+    float pressureGate = 0;         // host pressure (%) to collect the taskstats at; 0 for always
+    string querySocket;             // empty for no queries
+    string snapshotFile;            // empty for no shared-memory snapshots
+    unsigned snapshotMaxProcs = 16384;
+    string recorderFile;            // empty for no flight recorder
+    unsigned recorderSizeMB = 64;
+    string metricsListen;           // empty for no Prometheus endpoint
+    unsigned pollInterval = 0;      // msec, of the internal polls; 0 for SIGUSR1 only
+    bool changeOnly = false;        // output only the series that changed
+    float deadbandPct = 0;          // relative change (%) that counts, with changeOnly
+    float deadbandAbs = 0;          // absolute change that counts, with changeOnly
+    unsigned keyframeCycles = 10;   // cycles of full output, with changeOnly; 0 for never
+    unsigned outputQueue = 16;      // cycles of output kept while the consumer stalls
+    bool outputDropNewest = false;  // which cycle to drop once they are more; the oldest by default
+    float rankSmoothing = 0;        // weight of the latest values in the ranking averages; 0 for none
+    float rankHysteresis = 0;       // margin (%) of the top consumers to keep their ranks
+    float minCPU = 3.0;
+    float minRSS = 2.0e+7;  // 20 MB
+    float minRSSGrowth = 1.0e+6;    // 1 MB/min
+    float minIObytes = 5.0e+6; // 5 MB/s
+    float minIOdelays = 300.0e+6; // 300 msec/s
+    float minMajorFaults = 10;      // per sec
+    float minCtxSwitches = 1000;    // involuntary, per sec
+
+
+    // Strip the leading and trailing spaces
+    static string trim(const string& str)
     {
-        ::sort(t.begin(), t.end(), pC);
+        size_t start = str.find_first_not_of(" \t");
+        if (start == string::npos)
+            return "";
+        return str.substr(start, str.find_last_not_of(" \t") + 1 - start);
+    }
 
-        ushort size = (t.size() < N)? t.size() : N;
-        vector<T> output(size,0);
-        for (short i=0; i<size; i++) {
-            output[i] = t[i];
-        }
-        return output;
+    // Parse a list given as "[item1, item2, ...]"
+    strSet parse_list(string str)
+    {
+	    strSet items;
+	    string field;
+
+	    str = trim(str);
+		// remove bracket enclosure, if there
+	    string::size_type start_pos, end_pos;
+	    if ((start_pos = str.find_first_of('[')) == string::npos)
+	        start_pos = -1;
+	    if ((end_pos = str.find_last_of(']')) == string::npos)
+	        end_pos = str.length();
+
+	    start_pos++;
+
+	    str = str.substr(start_pos, end_pos-start_pos);
+	    stringstream ssInput(str);
+
+
+	    while ( getline(ssInput, field, ',') ){
+        	items.insert(trim(field));
+	    }
+	    return items;
+    }
+
+
+    void set_bucket_size(ushort N) { bucket_size = N; }
+    void set_aggregate() { aggregate = true; }
+    void set_rollup() { rollup = true; }
+    void set_users() { users = true; }
+    void set_rollupDepth(unsigned depth) { rollupDepth = depth; }
+    void set_rollupRoots(string str) { sRollupRoots = parse_list(str); }
+    void set_sampleInterval(unsigned msec) { sampleInterval = msec; }
+    void set_sampleTopN(ushort N) { sampleTopN = N; }
+    void set_threadTopM(ushort N) { threadTopM = N; }
+    void set_pss() { pss = true; }
+    void set_pssRefresh(unsigned sec) { pssRefresh = sec; }
+    void set_pssBudget(unsigned msec) { pssBudget = msec; }
+    void set_maxCycleMs(unsigned msec) { maxCycleMs = msec; }
+    void set_maxCPU(float pct) { maxCPU = pct; }
+    void set_ioUring() { ioUring = true; }
+    void set_stateFile(string path) { stateFile = path; }
+    void set_taskstats(bool on) { taskstats = on; }
+    void set_pressure() { pressure = true; }
+    void set_pressureGate(float pct) { pressureGate = pct; }
+    void set_querySocket(string path) { querySocket = path; }
+    void set_snapshotFile(string path) { snapshotFile = path; }
+    void set_snapshotMaxProcs(unsigned N) { snapshotMaxProcs = N; }
+    void set_recorderFile(string path) { recorderFile = path; }
+    void set_recorderSizeMB(unsigned size) { recorderSizeMB = size; }
+    void set_metricsListen(string address) { metricsListen = address; }
+    void set_pollInterval(unsigned msec) { pollInterval = msec; }
+    void set_changeOnly() { changeOnly = true; }
+    void set_deadbandPct(float pct) { deadbandPct = pct; }
+    void set_deadbandAbs(float thr) { deadbandAbs = thr; }
+    void set_keyframeCycles(unsigned N) { keyframeCycles = N; }
+    void set_outputQueue(unsigned N) { outputQueue = N; }
+    void set_rankSmoothing(float alpha)
+    {
+        if (alpha < 0 || alpha > 1)
+            throw invalid_argument("rankSmoothing");
+        rankSmoothing = alpha;
+    }
+    void set_rankHysteresis(float pct) { rankHysteresis = pct; }
+    void set_outputDrop(string policy)
+    {
+        if (policy != "oldest" && policy != "newest")
+            throw invalid_argument("outputDrop");
+        outputDropNewest = (policy == "newest");
+    }
+    void set_minCPU(float thr) { minCPU = thr; }
+    void set_minRSS(float thr) { minRSS = thr; }
+    void set_minRSSGrowth(float thr) { minRSSGrowth = thr; }
+    void set_minIObytes(float thr) { minIObytes = thr; }
+    void set_minIOdelays(float thr) { minIOdelays= thr; }
+    void set_minMajorFaults(float thr) { minMajorFaults = thr; }
+    void set_minCtxSwitches(float thr) { minCtxSwitches = thr; }
+
+	void set_includeProcs(string str) { add_rules(str, false); }
+	void set_excludeProcs(string str) { add_rules(str, true); }
+
+    void add_rules(const string& str, bool exclude)
+    {
+        if (!matcher)
+            matcher = make_shared<ProcMatcher>();
+        for (const string& rule : parse_list(str))
+            matcher->add(rule, exclude);
     }
-}
 
-class Measurements {
+    // Once all the rules are there
+    void compile_rules()
+    {
+        if (matcher)
+            matcher->compile();
+    }
+};
+
+class Measurements : private Settings {
 
     typedef unordered_map<pid_t, MonPID>  mProcesses;
     typedef mProcesses::iterator  mProcesses_iter;
     typedef unordered_set<string> strSet;
+    typedef unordered_map<pid_t, unordered_map<string, ushort>> mRanks;
     typedef OVLValue monPidAccessor() const;
-    using SteadyClock = std::chrono::steady_clock;
-    using TimePoint = std::chrono::time_point<SteadyClock>;
 
 
     mProcesses map_processes;
     unsigned CPU_jiffies = 1;
     short nCores = 1;
-    strSet sDuplicateProcs, sIncludeProcs;
+    strSet sDuplicateProcs;
     unordered_map<string, vector<int>> mRenameProcs;
     mProcesses mFinalProcHolder;
-    unordered_map<pid_t, unordered_map<string, ushort>> mRanksTracker;
+    mRanks mRanksTracker;
+    mRanks mPrevRanks;
 
-    TimePoint timepoint = SteadyClock::now();
+    // process-tree rollup
+    ProcTree tree;
+    unordered_map<pid_t, unsigned> mRollupCounts;
+    mProcesses mRollupHolder;
+    mRanks mRollupRanks;
+    mRanks mPrevRollupRanks;
 
-    ushort bucket_size = 5;
-    bool aggregate = false;
-    float minCPU = 3.0;
-    float minRSS = 2.0e+7;  // 20 MB
-    float minIObytes = 5.0e+6; // 5 MB/s
-    float minIOdelays = 300.0e+6; // 300 msec/s
+    // per-user totals, summed up during the scan
+    unordered_map<uid_t, MonPID> mUserTotals;
+    unordered_map<uid_t, unsigned> mUserCounts;
+    mProcesses mUserHolder;
+    mRanks mUserRanks;
+    mRanks mPrevUserRanks;
+    UserNames userNames;
+    OVLValue users_time_ns = 0;
+
+    // host pressure (PSI)
+    Pressure psi;
+    OVLValue taskstats_gated = 0;   // scans without the taskstats, for low pressure
+
+    // high-frequency sampling, in between the polls
+    Sampler sampler;
+
+    // processes of which the per-thread usage is tracked
+    unordered_set<pid_t> sThreadTracked;
+
+    // the instances of the aggregated processes
+    unordered_map<string, vector<pid_t>> mDuplMembers;
+    // cost of the PSS/USS reads
+    OVLValue pss_reads = 0;
+    OVLValue pss_deferred = 0;
+    OVLValue pss_time_ns = 0;
+
+
+    // the /proc listing of the last scan
+    ProcDir procdir;
+    vector<pid_t> vPrevPids;
+    unsigned new_processes = 0;
+    unsigned gone_processes = 0;
+
+    // batched reads of the /proc files (io_uring); NULL when disabled
+    ProcBatch* batch = NULL;
+
+    // the baseline counters, kept across restarts; NULL when disabled
+    Checkpoint* state = NULL;
+
+    // the queries over a Unix socket; NULL when disabled
+    QueryServer* query = NULL;
+
+    // the processes of every cycle, published in shared memory; NULL when disabled
+    Snapshot* snapshot = NULL;
+    OVLValue snapshot_time_ns = 0;
+
+    // the history of all the processes, in a ring file; NULL when disabled
+    FlightRecorder* recorder = NULL;
+    OVLValue recorder_time_ns = 0;
 
+    // the Prometheus endpoint, with the labels of the processes; NULL when disabled
+    MetricsServer* metrics = NULL;
+    unordered_map<pid_t, pair<string, string>> mMetricLabels;
+    OVLValue metrics_time_ns = 0;
 
-	void removeSpaces(string& strInput)
-	{
-	    char* str = const_cast<char*>(strInput.c_str());
+    // the series of a cycle, before they are written out; and their filter, NULL for all of them
+    ostringstream series;
+    ChangeFilter* changes = NULL;
 
-	    int count = 0;
+    // the output of the cycles, written out as fast as the consumer takes it
+    OutputQueue output{STDOUT_FILENO};
 
-	    for (int i = 0; str[i]; i++)
-	        if (str[i] != ' ')
-	            str[count++] = str[i];
-	    str[count] = '\0';
+    // the polls: from being asked for (a signal or the timer) to their start, and
+    // those coalesced into a pending one
+    OVLValue poll_latency_ns = 0;
+    OVLValue polls_coalesced = 0;
+
+    // budget of the scans
+    pid_t resume_pid = 0;           // where the last scan ran out of budget
+    OVLValue last_scan_ns = 0;
+    OVLValue scan_time_ns = 0;
+    OVLValue budget_exhausted = 0;
+    unsigned stale_processes = 0;
 
-	    strInput = str;
-	}
 
 
 
@@ -98,36 +310,354 @@ class Measurements {
     {
         mRenameProcs.clear();
         mFinalProcHolder.clear();
-        mRanksTracker.clear();
+        // the ranks of the previous cycle, for the hysteresis
+        mPrevRanks.clear();
+        mPrevRanks.swap(mRanksTracker);
+        mPrevRollupRanks.clear();
+        mPrevRollupRanks.swap(mRollupRanks);
+        mPrevUserRanks.clear();
+        mPrevUserRanks.swap(mUserRanks);
+        mRollupHolder.clear();
+        mRollupCounts.clear();
+        mDuplMembers.clear();
+        mUserHolder.clear();
+    }
+
+
+    // Get the top consumers while filtering out, based on the minimum threasholds. They are ranked
+    // by the moving averages of their values, if enabled; and the top consumers of the previous
+    // cycle are ranked as if they were larger by the hysteresis margin, so that they keep their
+    // places (and their series) unless clearly beaten, or clearly below the threshold
+    void top_consumers(float threshold, RankedMetric metric,
+        const vector<MonPID> &vProcsToSort, const string rank_label,
+        mProcesses& holder, mRanks& ranks, const mRanks& previous)
+    {
+        typedef pair<double, const MonPID*> Scored;
+        vector<Scored> vScored;
+        for (const MonPID& proc : vProcsToSort) {
+            double value = proc.get_ranked(metric);
+            if (rankHysteresis > 0) {
+                auto p_it = previous.find(proc.get_pid());
+                if (p_it != previous.end() && p_it->second.count(rank_label))
+                    value *= 1 + rankHysteresis / 100;
+            }
+            if (value > threshold)
+                vScored.push_back(make_pair(value, &proc));
+        }
+
+        // the ties in the order of their pids, to keep the same ranks from cycle to cycle
+        size_t N = min<size_t>(bucket_size, vScored.size());
+        partial_sort(vScored.begin(), vScored.begin() + N, vScored.end(),
+            [](const Scored& a, const Scored& b) {
+                return a.first > b.first || (a.first == b.first && a.second->get_pid() < b.second->get_pid());
+            });
+
+        for (size_t i = 0; i < N; i++) {
+            pid_t pid = vScored[i].second->get_pid();
+            holder[pid] = *vScored[i].second;
+            ranks[pid][rank_label] = i+1;
+        }
     }
 
+    // Rank the top consumers of every metric
+    void rank_consumers(const vector<MonPID> &vProcsToSort,
+        mProcesses& holder, mRanks& ranks, const mRanks& previous)
+    {
+        // ... of CPU usage
+        top_consumers(minCPU*CPU_jiffies/100/nCores,
+            RANK_CPU,
+            vProcsToSort,
+            "cpu_usage_topk_rank", holder, ranks, previous);
+
+        // ... of Memory
+        top_consumers(minRSS,
+            RANK_RSS,
+            vProcsToSort,
+            "memory_rss_topk_rank", holder, ranks, previous);
+
+        // ... of Memory growth
+        top_consumers(minRSSGrowth,
+            RANK_RSS_GROWTH,
+            vProcsToSort,
+            "memory_growth_topk_rank", holder, ranks, previous);
+
+        // ... of read bytes
+        top_consumers(minIObytes,
+            RANK_READ_BYTES,
+            vProcsToSort,
+            "read_bytes_topk_rank", holder, ranks, previous);
+
+        // ... of written bytes
+        top_consumers(minIObytes,
+            RANK_WRITE_BYTES,
+            vProcsToSort,
+            "write_bytes_topk_rank", holder, ranks, previous);
+
+        // ... of block I/O delays
+        top_consumers(minIOdelays,
+            RANK_BLKIO_DELAY,
+            vProcsToSort,
+            "blkio_delay_topk_rank", holder, ranks, previous);
 
-    // Get the top consumers while filtering out, based on the minimum threasholds
-    void top_consumers(float threshold, monPidAccessor MonPID::*accessor, pComparator<MonPID> pC,
-        vector<MonPID> &vProcsToSort, const string rank_label)
+        // ... of swap-in delays
+        top_consumers(minIOdelays,
+            RANK_SWAPIN_DELAY,
+            vProcsToSort,
+            "swapin_delay_topk_rank", holder, ranks, previous);
+
+        // ... of cpu delays
+        top_consumers(minIOdelays,
+            RANK_CPU_DELAY,
+            vProcsToSort,
+            "cpu_delay_topk_rank", holder, ranks, previous);
+
+        // ... of major page faults
+        top_consumers(minMajorFaults,
+            RANK_MAJOR_FAULTS,
+            vProcsToSort,
+            "major_faults_topk_rank", holder, ranks, previous);
+
+        // ... of involuntary context switches
+        top_consumers(minCtxSwitches,
+            RANK_INVOL_CTXT_SWITCHES,
+            vProcsToSort,
+            "involuntary_ctxt_switches_topk_rank", holder, ranks, previous);
+    }
+
+    // The roots of the rollup trees: either the top-most processes of the given names (or pids),
+    // or all the processes at the given depth
+    vector<pid_t> rollup_roots()
     {
-        vector<MonPID> vTemp = sort(vProcsToSort, pC, bucket_size);
+        if (sRollupRoots.empty())
+            return tree.at_depth(rollupDepth);
 
-        for (ushort i=0; i<vTemp.size(); i++) {
-            if ((vTemp[i].*accessor)() <= threshold)
+        vector<pid_t> vRoots;
+        auto is_root = [this](pid_t pid) -> bool {
+            auto it = map_processes.find(pid);
+            return it != map_processes.end() &&
+                (sRollupRoots.count(it->second.get_name()) || sRollupRoots.count(to_string(pid)));
+        };
+        for (const auto& it : map_processes) {
+            if (!is_root(it.first))
+                continue;
+            // skip it, if one of its ancestors is already a root; a stale parent (of a
+            // recycled pid) could make a loop, so never go up more than all of them
+            pid_t ppid = tree.get_parent(it.first);
+            size_t budget = tree.size();
+            while (ppid != 0 && !is_root(ppid) && budget--)
+                ppid = tree.get_parent(ppid);
+            if (ppid == 0 || !is_root(ppid))
+                vRoots.push_back(it.first);
+        }
+        return vRoots;
+    }
+
+    // Sum up the subtrees of the rollup roots, and rank them like the processes
+    void rollup_processes()
+    {
+        vector<MonPID> vTrees;
+        for (pid_t root : rollup_roots()) {
+            auto r_it = map_processes.find(root);
+            if (r_it == map_processes.end())
+                continue;
+
+            MonPID total = r_it->second;
+            unsigned count = 0;
+            tree.walk(root, [&](pid_t pid) {
+                auto it = map_processes.find(pid);
+                if (it == map_processes.end())
+                    return;
+                if (pid != root)
+                    total += it->second;
+                count++;
+            });
+            total.fold_reaped();
+            mRollupCounts[root] = count;
+            vTrees.push_back(total);
+        }
+
+        rank_consumers(vTrees, mRollupHolder, mRollupRanks, mPrevRollupRanks);
+    }
+
+    // The processes to sample until the next poll: the top consumers of CPU and of I/O,
+    // regardless of the thresholds, since a burst is what we are after
+    void sample_candidates()
+    {
+        ushort N = sampleTopN ? sampleTopN : bucket_size;
+        vector<const MonPID*> vProcs;
+        vProcs.reserve(map_processes.size());
+        // not the ones that are never reported on their own, as output_top_processes() has it
+        for (const auto& it : map_processes)
+            if (!it.second.is_excluded() && !sDuplicateProcs.count(it.second.get_name()))
+                vProcs.push_back(&it.second);
+        N = min<size_t>(N, vProcs.size());
+
+        vector<pid_t> vCandidates;
+        auto top_of = [&](pComparator<MonPID> pC) {
+            partial_sort(vProcs.begin(), vProcs.begin() + N, vProcs.end(),
+                [pC](const MonPID* a, const MonPID* b) { return pC(*a, *b); });
+            for (ushort i = 0; i < N; i++)
+                vCandidates.push_back(vProcs[i]->get_pid());
+        };
+        top_of(compare_by_CPU);
+        top_of(compare_by_IO_Read_Bytes);
+        top_of(compare_by_IO_Write_Bytes);
+
+        sampler.set_candidates(vCandidates);
+    }
+
+    // The fields common to the processes and their aggregates
+    void output_fields(const MonPID& proc, ostream& out)
+    {
+        out <<
+            ",memory_rss="      << proc.get_RSS()                                     << 'i' <<
+            ",memory_swap="     << proc.get_swap()                                    << 'i' <<
+            ",memory_rss_anon=" << proc.get_RSS_anon()                                << 'i' <<
+            ",memory_rss_file=" << proc.get_RSS_file()                                << 'i' <<
+            ",memory_growth_bytes_per_min=" << proc.get_RSS_growth()                  << 'i' <<
+            ",read_bytes="      << proc.get_read_bytes_rate()                         << 'i' <<
+            ",write_bytes="     << proc.get_write_bytes_rate()                        << 'i' <<
+            ",cpu_delay="       << proc.get_cpu_delay_rate()/M                        << 'i' <<
+            ",blkio_delay="     << proc.get_blkio_delay_rate()/M                      << 'i' <<
+            ",swapin_delay="    << proc.get_swapin_delay_rate()/M                     << 'i' <<
+            ",minor_faults="    << proc.get_minor_faults_rate()                       << 'i' <<
+            ",major_faults="    << proc.get_major_faults_rate()                       << 'i' <<
+            ",voluntary_ctxt_switches="   << proc.get_vol_ctxt_switches_rate()        << 'i' <<
+            ",involuntary_ctxt_switches=" << proc.get_invol_ctxt_switches_rate()      << 'i';
+    }
+
+    // The pids of the instances of an aggregated process, or just its own pid
+    vector<pid_t> instances(const MonPID& proc)
+    {
+        auto d_it = mDuplMembers.find(proc.get_name());
+        if (d_it == mDuplMembers.end())
+            return vector<pid_t>(1, proc.get_pid());
+        return d_it->second;
+    }
+
+    // Refresh the PSS/USS of the top processes by RSS, when older than pssRefresh,
+    // within the time budget of the cycle
+    void refresh_pss()
+    {
+        OVLValue start_ns = monotonic_ns();
+        OVLValue budget_ns = OVLValue(pssBudget) * M;
+        OVLValue refresh_ns = OVLValue(pssRefresh) * K * M;
+
+        // the processes to read, by their RSS rank
+        vector<pair<ushort, pid_t>> vRanked;
+        for (const auto& it : mRanksTracker) {
+            auto r_it = it.second.find("memory_rss_topk_rank");
+            if (r_it != it.second.end())
+                vRanked.push_back(make_pair(r_it->second, it.first));
+        }
+        sort(vRanked.begin(), vRanked.end());
+
+        vector<MonPID*> vStale;
+        for (const auto& it : vRanked)
+            for (pid_t pid : instances(mFinalProcHolder[it.second])) {
+                auto m_it = map_processes.find(pid);
+                if (m_it != map_processes.end() &&
+                    (m_it->second.get_pss_ns() == 0 || start_ns - m_it->second.get_pss_ns() >= refresh_ns))
+                    vStale.push_back(&m_it->second);
+            }
+
+        // never read before first, then the oldest
+        stable_sort(vStale.begin(), vStale.end(), [](const MonPID* a, const MonPID* b) {
+            return a->get_pss_ns() < b->get_pss_ns();
+        });
+
+        // at least one read per cycle, so that all of them get refreshed eventually
+        for (size_t i = 0; i < vStale.size(); i++) {
+            if (i > 0 && monotonic_ns() - start_ns >= budget_ns) {
+                pss_deferred += vStale.size() - i;
                 break;
-            else
-            {
-                pid_t pid = vTemp[i].get_pid();
-                mFinalProcHolder[pid] = vTemp[i];
-                mRanksTracker[pid][rank_label] = i+1;
             }
+            vStale[i]->update_pss();
+            pss_reads++;
+        }
+        pss_time_ns += monotonic_ns() - start_ns;
+    }
+
+    // The PSS and USS of a top process (or the sum of its instances); false if not known
+    bool get_pss(const MonPID& proc, OVLValue& pss_sum, OVLValue& uss_sum)
+    {
+        pss_sum = uss_sum = 0;
+        for (pid_t pid : instances(proc)) {
+            auto m_it = map_processes.find(pid);
+            if (m_it == map_processes.end() || !m_it->second.has_pss())
+                return false;
+            pss_sum += m_it->second.get_pss();
+            uss_sum += m_it->second.get_uss();
+        }
+        return true;
+    }
+
+    // The top threads (by CPU) of a top process
+    void output_threads(const MonPID& proc, const string& pname)
+    {
+        const mThreadStats* threads = proc.get_threads();
+        OVLValue interval_ns = proc.get_interval_ns();
+        if (threads == NULL || interval_ns == 0)
+            return;
+
+        vector<pair<pid_t, const ThreadStats*>> vThreads;
+        for (const auto& it : *threads)
+            if (it.second.primed)
+                vThreads.push_back(make_pair(it.first, &it.second));
+
+        size_t N = min<size_t>(threadTopM, vThreads.size());
+        partial_sort(vThreads.begin(), vThreads.begin() + N, vThreads.end(),
+            [](const pair<pid_t, const ThreadStats*>& a, const pair<pid_t, const ThreadStats*>& b) {
+                return a.second->cpu_delta > b.second->cpu_delta;
+            });
+
+        unordered_map<string, vector<int>> mRenameThreads;
+        for (size_t i = 0; i < N; i++) {
+            const ThreadStats& th = *vThreads[i].second;
+            float cpu_usage = 100*nCores * th.cpu_delta/(float) CPU_jiffies;
+            string name = process_name(th.name, vThreads[i].first, mRenameThreads);
+            replace(name.begin(), name.end(), ' ', '_');
+
+            series << "procstat_thread,process_name=" << pname << ",thread_name=" << name <<
+                " tid="             << vThreads[i].first                                    << 'i' <<
+                ",cpu_usage="       << cpu_usage                                            <<
+                ",cpu_delay="       << OVLValue(th.cpu_delay_delta * 1.0e3 / interval_ns)   << 'i' <<
+                ",blkio_delay="     << OVLValue(th.blkio_delay_delta * 1.0e3 / interval_ns) << 'i' <<
+                ",thread_topk_rank=" << i+1                                                 << 'i' << endl;
+        }
+    }
+
+    // Track the threads of the (non-aggregated) top processes only, to keep the cost low
+    void track_threads()
+    {
+        unordered_set<pid_t> sTrack;
+        for (const auto& it : mFinalProcHolder)
+            if (sDuplicateProcs.count(it.second.get_name()) == 0)
+                sTrack.insert(it.first);
+
+        for (pid_t pid : sThreadTracked)
+            if (sTrack.count(pid) == 0) {
+                auto m_it = map_processes.find(pid);
+                if (m_it != map_processes.end())
+                    m_it->second.set_thread_tracking(false);
+            }
+        for (pid_t pid : sTrack) {
+            auto m_it = map_processes.find(pid);
+            if (m_it != map_processes.end())
+                m_it->second.set_thread_tracking(true);
         }
+        sThreadTracked.swap(sTrack);
     }
 
     // rename multiple processes by appending an index to their names
-    string process_name(const string pname, const int pid)
+    string process_name(const string pname, const int pid,
+        unordered_map<string, vector<int>>& mRename)
     {
         // track the processes per pid
-        auto it = mRenameProcs.find(pname);
+        auto it = mRename.find(pname);
         // processes by this name  not yet recorded
-        if (it == mRenameProcs.end()) {
-            mRenameProcs.insert(pair<string, vector<int>> (pname, {pid}));
+        if (it == mRename.end()) {
+            mRename.insert(pair<string, vector<int>> (pname, {pid}));
             return pname;
         } else {
             vector<int>& vPids = it->second;
@@ -149,6 +679,8 @@ class Measurements {
 
 public:
 
+    ~Measurements() { delete batch; delete state; delete query; delete snapshot; delete recorder; delete metrics; delete changes; }
+
     Measurements() {
         nCores = sysconf(_SC_NPROCESSORS_ONLN);
         if (nCores == 0) {
@@ -157,73 +689,610 @@ public:
 
     }
 
-    void set_bucket_size(ushort N) { bucket_size = N; }
-    void set_aggregate() { aggregate = true; }
-    void set_minCPU(float thr) { minCPU = thr; }
-    void set_minRSS(float thr) { minRSS = thr; }
-    void set_minIObytes(float thr) { minIObytes = thr; }
-    void set_minIOdelays(float thr) { minIOdelays= thr; }
+    // Take new settings, in between two cycles. The collected state is kept, and the
+    // subsystems that the new settings enable or disable are started or stopped
+    void configure(const Settings& settings)
+    {
+        Settings previous = *this;
+        Settings::operator=(settings);
+
+        if (ioUring && !batch) {
+            batch = new ProcBatch();
+            if (!batch->ready()) {
+                delete batch;
+                batch = NULL;
+            }
+        } else if (!ioUring && batch) {
+            delete batch;
+            batch = NULL;
+        }
 
-	void set_includeProcs(string str) {
+        if (stateFile != previous.stateFile) {
+            delete state;
+            state = NULL;
+            if (!stateFile.empty()) {
+                state = new Checkpoint(stateFile);
+                // only on start; later on, the current state is newer
+                if (map_processes.empty())
+                    restore();
+            }
+        }
 
-	    string field;
+        if (!threadTopM && previous.threadTopM) {
+            for (pid_t pid : sThreadTracked) {
+                auto m_it = map_processes.find(pid);
+                if (m_it != map_processes.end())
+                    m_it->second.set_thread_tracking(false);
+            }
+            sThreadTracked.clear();
+        }
 
-	    removeSpaces(str);
-		// remove bracket enclosure, if there
-	    string::size_type start_pos, end_pos;
-	    if ((start_pos = str.find_first_of('[')) == string::npos)
-	        start_pos = -1;
-	    if ((end_pos = str.find_last_of(']')) == string::npos)
-	        end_pos = str.length();
+        // the tree is only kept up to date while it is needed
+        if (!rollup && previous.rollup)
+            tree = ProcTree();
 
-	    start_pos++;
+        if (!sampleInterval && previous.sampleInterval)
+            sampler.set_candidates(vector<pid_t>());
 
-	    str = str.substr(start_pos, end_pos-start_pos);
-	    stringstream ssInput(str);
+        MonPID::set_taskstats(taskstats);
+        MonPID::set_smoothing(rankSmoothing);
 
+        if (matcher != previous.matcher)
+            MonPID::set_matcher(matcher.get());
 
-	    while ( getline(ssInput, field, ',') ){
-        	sIncludeProcs.insert(field);
-	    }
-	}
+        if (querySocket != previous.querySocket) {
+            delete query;
+            query = NULL;
+            if (!querySocket.empty()) {
+                query = new QueryServer(querySocket,
+                    [this](const string& request, ostream& out) { answer_query(request, out); });
+                if (!query->ready()) {
+                    delete query;
+                    query = NULL;
+                }
+            }
+        }
 
-    bool scan_all_processes()
+        if (snapshotFile != previous.snapshotFile || snapshotMaxProcs != previous.snapshotMaxProcs) {
+            delete snapshot;
+            snapshot = NULL;
+            if (!snapshotFile.empty()) {
+                snapshot = new Snapshot(snapshotFile, snapshotMaxProcs);
+                if (!snapshot->ready()) {
+                    delete snapshot;
+                    snapshot = NULL;
+                }
+            }
+        }
+
+        if (recorderFile != previous.recorderFile || recorderSizeMB != previous.recorderSizeMB) {
+            delete recorder;
+            recorder = NULL;
+            if (!recorderFile.empty()) {
+                recorder = new FlightRecorder(recorderFile, size_t(recorderSizeMB) << 20);
+                if (!recorder->ready()) {
+                    delete recorder;
+                    recorder = NULL;
+                }
+            }
+        }
+
+        if (metricsListen != previous.metricsListen) {
+            delete metrics;
+            metrics = NULL;
+            mMetricLabels.clear();
+            if (!metricsListen.empty()) {
+                metrics = new MetricsServer(metricsListen);
+                if (!metrics->ready()) {
+                    delete metrics;
+                    metrics = NULL;
+                }
+            }
+        }
+
+        // the series are emitted in full once, on a change of the deadband
+        if (changeOnly != previous.changeOnly || deadbandPct != previous.deadbandPct ||
+                deadbandAbs != previous.deadbandAbs || keyframeCycles != previous.keyframeCycles) {
+            delete changes;
+            changes = changeOnly ? new ChangeFilter(deadbandPct / 100, deadbandAbs, keyframeCycles) : NULL;
+        }
+
+        output.set_limit(outputQueue, outputDropNewest);
+    }
+
+    // The descriptors of the output, the queries and the scrapes, to wait on along with the signals
+    void poll_fds(vector<pollfd>& fds) const
     {
+        output.poll_fds(fds);
+        if (query)
+            query->poll_fds(fds);
+        if (metrics)
+            metrics->poll_fds(fds);
+    }
 
-        // Read all entries in /proc -- skipping those that don't start with 1..9
-        DIR* procdir = opendir ("/proc");
-        if (procdir == NULL)
-        {
-            OvlError("Failed to read '/proc', errno %d: %s",
-                errno, strerror(errno));
+    // Close the query and metrics connections that have run out of time
+    void expire_clients()
+    {
+        OVLValue now_ns = monotonic_ns();
+        if (query)
+            query->expire(now_ns);
+        if (metrics)
+            metrics->expire(now_ns);
+    }
+    bool has_clients_to_expire() const { return query || metrics; }
+
+    // Serve the output, the queries and the scrapes that are ready; true if any was
+    bool serve_sockets(const vector<pollfd>& fds)
+    {
+        bool served = output.serve(fds);
+        served = (query && query->serve(fds)) || served;
+        return (metrics && metrics->serve(fds)) || served;
+    }
+
+    // Answer a query from the processes of the last scan:
+    //   top <N> <metric>   the top N processes by a metric (of the ranked ones)
+    //   pid <pid>          a process
+    //   name <rule>        the processes of a name, glob or regex (as for includeProcs)
+    void answer_query(const string& request, ostream& out)
+    {
+        static const struct {
+            const char*         name;
+            pComparator<MonPID> compare;
+        } metrics[] = {
+            { "cpu_usage",                  compare_by_CPU },
+            { "memory_rss",                 compare_by_RSS },
+            { "memory_growth",              compare_by_RSS_growth },
+            { "read_bytes",                 compare_by_IO_Read_Bytes },
+            { "write_bytes",                compare_by_IO_Write_Bytes },
+            { "blkio_delay",                compare_by_blkio_delay },
+            { "swapin_delay",               compare_by_swapin_delay },
+            { "cpu_delay",                  compare_by_cpu_delay },
+            { "major_faults",               compare_by_major_faults },
+            { "involuntary_ctxt_switches",  compare_by_invol_ctxt_switches },
+        };
+
+        istringstream in(request);
+        string command;
+        in >> command;
+
+        if (command == "top") {
+            unsigned N;
+            string metric;
+            if (!(in >> N >> metric)) {
+                out << "error: usage: top <N> <metric>\n";
+                return;
+            }
+            pComparator<MonPID> pC = NULL;
+            for (const auto& m : metrics)
+                if (metric == m.name)
+                    pC = m.compare;
+            if (!pC) {
+                out << "error: unknown metric '" << metric << "'\n";
+                return;
+            }
+
+            vector<const MonPID*> vProcs;
+            vProcs.reserve(map_processes.size());
+            for (const auto& it : map_processes)
+                if (!it.second.is_excluded())
+                    vProcs.push_back(&it.second);
+            size_t n = min(size_t(N), vProcs.size());
+            partial_sort(vProcs.begin(), vProcs.begin() + n, vProcs.end(),
+                [pC](const MonPID* a, const MonPID* b) { return pC(*a, *b); });
+            for (size_t i = 0; i < n; i++)
+                output_query(*vProcs[i], out);
+        }
+        else if (command == "pid") {
+            pid_t pid;
+            if (!(in >> pid)) {
+                out << "error: usage: pid <pid>\n";
+                return;
+            }
+            auto it = map_processes.find(pid);
+            if (it == map_processes.end() || it->second.is_excluded()) {
+                out << "error: no process " << pid << "\n";
+                return;
+            }
+            output_query(it->second, out);
+        }
+        else if (command == "name") {
+            string rule;
+            getline(in, rule);
+            rule = trim(rule);
+            ProcMatcher names;
+            try {
+                names.add(rule, false);
+                names.compile();
+            }
+            catch (const invalid_argument& e) {
+                out << "error: " << e.what() << "\n";
+                return;
+            }
+            // the command lines are not kept
+            if (rule.empty() || names.needs_cmdline()) {
+                out << "error: usage: name <name|glob|re:regex>\n";
+                return;
+            }
+            for (const auto& it : map_processes)
+                if (!it.second.is_excluded() &&
+                        names.match(it.second.get_name(), "") == ProcMatcher::INCLUDE)
+                    output_query(it.second, out);
+        }
+        else if (command == "help") {
+            out << "top <N> <metric>\npid <pid>\nname <name|glob|re:regex>\nmetrics:";
+            for (const auto& m : metrics)
+                out << ' ' << m.name;
+            out << "\n";
+        }
+        else
+            out << "error: unknown command '" << command << "'; try 'help'\n";
+    }
+
+    // A process in the response to a query
+    void output_query(const MonPID& proc, ostream& out)
+    {
+        float cpu_usage = 100*nCores * proc.get_cpu()/(float) CPU_jiffies;
+        string name = proc.get_name();
+        replace(name.begin(), name.end(), ' ', '_');
+
+        out << "procstat,process_name=" << name <<
+            " pid="             << proc.get_pid()                                     << 'i' <<
+            ",cpu_usage="       << cpu_usage;
+        output_fields(proc, out);
+        out <<
+            ",num_threads="     << proc.get_num_threads()                             << 'i' <<
+            ",priority="        << proc.get_priority()                                << 'i' <<
+            ",nice="            << proc.get_nice()                                    << 'i' << '\n';
+    }
+
+    unsigned get_sampleInterval() const { return sampleInterval; }
+    unsigned get_pollInterval() const { return pollInterval; }
+
+    void set_poll_latency(OVLValue ns) { poll_latency_ns = ns; }
+    void add_coalesced_polls(OVLValue count) { polls_coalesced += count; }
+
+    void sample() { sampler.sample(); }
+
+    // Start the sampling of a new polling period, with the current top consumers
+    void restart_sampling()
+    {
+        if (!sampleInterval)
+            return;
+        sampler.reset();
+        sample_candidates();
+    }
+
+    // Forget a process that is no longer running
+    void remove_process(mProcesses_iter it)
+    {
+        #ifdef DEBUG
+        OvlInfo("Removed process: %u (%s)\n", it->first, it->second.get_name().c_str());
+        #endif //DEBUG
+        if (rollup) {
+            // its parent has (most likely) reaped it, so its cutime/cstime include
+            // the lifetime CPU of this process; discount what was already seen
+            auto p_it = map_processes.find(it->second.get_ppid());
+            if (p_it != map_processes.end())
+                p_it->second.discount_reaped(it->second.get_cpu_lifetime());
+            tree.remove(it->first);
+        }
+        map_processes.erase(it);
+        gone_processes++;
+    }
+
+    // True if the scan has used up its budget (checked every few processes, as it costs a syscall)
+    bool over_budget(unsigned scanned, OVLValue start_ns, OVLValue start_cpu_ns, OVLValue cpu_budget_ns)
+    {
+        if (scanned == 0 || scanned % 16)
             return false;
+        if (maxCycleMs && monotonic_ns() - start_ns >= OVLValue(maxCycleMs) * M)
+            return true;
+        return cpu_budget_ns && process_cpu_ns() - start_cpu_ns >= cpu_budget_ns;
+    }
+
+    // Reload the baseline of the processes and of the CPU, as saved before a restart,
+    // so that the first scan already gives their deltas
+    void restore()
+    {
+        CpuUsage cpu;
+        vector<PidCheckpoint> records;
+        if (!state->load(cpu, records))
+            return;
+
+        setLastCPU(cpu);
+        for (const auto& rec : records) {
+            map_processes.insert(make_pair(rec.pid, MonPID(rec)));
+            vPrevPids.push_back(rec.pid);
         }
+        sort(vPrevPids.begin(), vPrevPids.end());
+        OvlInfo("Restored %zu processes from the checkpoint", records.size());
+    }
+
+    // Save the baseline of the processes and of the CPU, for a restart
+    void checkpoint()
+    {
+        if (!state)
+            return;
+        vector<PidCheckpoint> records(map_processes.size());
+        size_t n = 0;
+        for (const auto& it : map_processes)
+            it.second.checkpoint(records[n++]);
+        state->save(lastCPU(), records);
+    }
 
-        // Mark all the monitored entries 'not found' so we'll know which ones
-        // to remove at the end.
-        for (auto& it : map_processes) {
-            it.second.set_found(false);
+    // Publish the processes of the cycle, for the local readers
+    void publish_snapshot()
+    {
+        if (!snapshot)
+            return;
+        OVLValue start_ns = monotonic_ns();
+        snapshot->begin();
+        for (const auto& it : map_processes) {
+            const MonPID& proc = it.second;
+            if (proc.is_excluded())
+                continue;
+            SnapshotRecord* rec = snapshot->add(proc.get_name());
+            if (rec == NULL)
+                continue;
+            rec->pid            = proc.get_pid();
+            rec->ppid           = proc.get_ppid();
+            rec->uid            = proc.get_uid();
+            rec->starttime      = proc.get_starttime();
+            rec->cpu_usage      = 100*nCores * proc.get_cpu()/(float) CPU_jiffies;
+            rec->num_threads    = proc.get_num_threads();
+            rec->priority       = proc.get_priority();
+            rec->nice           = proc.get_nice();
+            rec->memory_rss     = proc.get_RSS();
+            rec->memory_swap    = proc.get_swap();
+            rec->memory_rss_anon = proc.get_RSS_anon();
+            rec->memory_rss_file = proc.get_RSS_file();
+            rec->read_bytes     = proc.get_read_bytes_rate();
+            rec->write_bytes    = proc.get_write_bytes_rate();
+            rec->cpu_delay      = proc.get_cpu_delay_rate();
+            rec->blkio_delay    = proc.get_blkio_delay_rate();
+            rec->swapin_delay   = proc.get_swapin_delay_rate();
+            rec->minor_faults   = proc.get_minor_faults_rate();
+            rec->major_faults   = proc.get_major_faults_rate();
+            rec->voluntary_ctxt_switches   = proc.get_vol_ctxt_switches_rate();
+            rec->involuntary_ctxt_switches = proc.get_invol_ctxt_switches_rate();
         }
+        snapshot->publish(nCores);
+        snapshot_time_ns = monotonic_ns() - start_ns;
+    }
 
-        if (aggregate) sDuplicateProcs.clear();
+    // The labels of a reported process, escaped for Prometheus; kept from cycle to cycle
+    const string& metric_labels(const MonPID& proc, unordered_map<pid_t, pair<string, string>>& cache)
+    {
+        pid_t pid = proc.get_pid();
+        string name = proc.get_name();
+        // an aggregated process stands for all its instances
+        bool aggregated = sDuplicateProcs.count(name) != 0;
+        if (aggregated)
+            name += '*';
+
+        auto m_it = mMetricLabels.find(pid);
+        if (m_it != mMetricLabels.end() && m_it->second.first == name)
+            return (cache[pid] = m_it->second).second;
+
+        string label = "process_name=\"";
+        for (char c : proc.get_name()) {
+            if (c == '\\' || c == '"')
+                label += '\\';
+            if (c == '\n')
+                label += "\\n";
+            else
+                label += c;
+        }
+        label += '"';
+        if (!aggregated)
+            label += ",pid=\"" + to_string(pid) + '"';
+        return (cache[pid] = make_pair(name, label)).second;
+    }
+
+    // Render the reported processes and procstat's own metrics for the Prometheus scrapes,
+    // once per cycle
+    void expose_metrics()
+    {
+        static const struct {
+            const char*         name;
+            const char*         help;
+            monPidAccessor MonPID::*get;
+            OVLValue            divisor;
+        } fields[] = {
+            { "memory_rss",         "Resident memory (bytes)",              &MonPID::get_RSS,           1 },
+            { "memory_swap",        "Swapped out memory (bytes)",           &MonPID::get_swap,          1 },
+            { "memory_rss_anon",    "Resident anonymous memory (bytes)",    &MonPID::get_RSS_anon,      1 },
+            { "memory_rss_file",    "Resident file mappings (bytes)",       &MonPID::get_RSS_file,      1 },
+            { "read_bytes",         "Bytes read from storage, per sec",     &MonPID::get_read_bytes_rate,  1 },
+            { "write_bytes",        "Bytes written to storage, per sec",    &MonPID::get_write_bytes_rate, 1 },
+            { "cpu_delay",          "Delay waiting for a CPU (msec/sec)",   &MonPID::get_cpu_delay_rate,    M },
+            { "blkio_delay",        "Delay waiting for block I/O (msec/sec)", &MonPID::get_blkio_delay_rate, M },
+            { "swapin_delay",       "Delay waiting for swap-in (msec/sec)", &MonPID::get_swapin_delay_rate, M },
+            { "minor_faults",       "Minor page faults, per sec",           &MonPID::get_minor_faults_rate, 1 },
+            { "major_faults",       "Major page faults, per sec",           &MonPID::get_major_faults_rate, 1 },
+            { "voluntary_ctxt_switches",   "Voluntary context switches, per sec",   &MonPID::get_vol_ctxt_switches_rate,   1 },
+            { "involuntary_ctxt_switches", "Involuntary context switches, per sec", &MonPID::get_invol_ctxt_switches_rate, 1 },
+            { "num_threads",        "Threads",                              &MonPID::get_num_threads,   1 },
+        };
+        if (!metrics)
+            return;
+        OVLValue start_ns = monotonic_ns();
+
+        // the labels of the processes that are gone are dropped
+        unordered_map<pid_t, pair<string, string>> labels;
+        vector<pair<const MonPID*, const string*>> vProcs;
+        for (const auto& it : mFinalProcHolder)
+            vProcs.push_back(make_pair(&it.second, &metric_labels(it.second, labels)));
+        mMetricLabels.swap(labels);
+
+        ostringstream body;
+        body << "# HELP procstat_cpu_usage CPU usage (% of one core)\n"
+                "# TYPE procstat_cpu_usage gauge\n";
+        for (const auto& it : vProcs)
+            body << "procstat_cpu_usage{" << *it.second << "} " <<
+                100*nCores * it.first->get_cpu()/(float) CPU_jiffies << '\n';
+        body << "# HELP procstat_memory_growth_bytes_per_min Growth of the resident memory (bytes/min)\n"
+                "# TYPE procstat_memory_growth_bytes_per_min gauge\n";
+        for (const auto& it : vProcs)
+            body << "procstat_memory_growth_bytes_per_min{" << *it.second << "} " <<
+                it.first->get_RSS_growth() << '\n';
+        for (const auto& field : fields) {
+            body << "# HELP procstat_" << field.name << ' ' << field.help << "\n"
+                    "# TYPE procstat_" << field.name << " gauge\n";
+            for (const auto& it : vProcs)
+                body << "procstat_" << field.name << '{' << *it.second << "} " <<
+                    (it.first->*field.get)() / field.divisor << '\n';
+        }
+
+        body << "# HELP procstat_processes Processes tracked\n"
+                "# TYPE procstat_processes gauge\n"
+                "procstat_processes " << map_processes.size() << "\n"
+                "# HELP procstat_pid_reuses_total Recycled pids detected\n"
+                "# TYPE procstat_pid_reuses_total counter\n"
+                "procstat_pid_reuses_total " << MonPID::get_pid_reuses() << "\n"
+                "# HELP procstat_scan_time_seconds Duration of the last scan\n"
+                "# TYPE procstat_scan_time_seconds gauge\n"
+                "procstat_scan_time_seconds " << scan_time_ns / 1.0e9 << "\n"
+                "# HELP procstat_scrapes_total Scrapes served\n"
+                "# TYPE procstat_scrapes_total counter\n"
+                "procstat_scrapes_total " << metrics->get_scrapes() << '\n';
+        metrics->publish(body.str());
+        metrics_time_ns = monotonic_ns() - start_ns;
+    }
+
+    // Append the processes of the cycle to the flight recorder
+    void record_history()
+    {
+        if (!recorder)
+            return;
+        OVLValue start_ns = monotonic_ns();
+        recorder->begin(nCores, CPU_jiffies);
+        for (const auto& it : map_processes) {
+            const MonPID& proc = it.second;
+            if (proc.is_excluded())
+                continue;
+            uint64_t* values = recorder->add(proc.get_pid(), proc.get_name());
+            values[REC_PPID]            = proc.get_ppid();
+            values[REC_UID]             = proc.get_uid();
+            values[REC_STARTTIME]       = proc.get_starttime();
+            values[REC_CPU]             = proc.get_cpu();
+            values[REC_THREADS]         = proc.get_num_threads();
+            values[REC_RSS]             = proc.get_RSS() / 1024;
+            values[REC_SWAP]            = proc.get_swap() / 1024;
+            values[REC_READ_BYTES]      = proc.get_read_bytes_rate();
+            values[REC_WRITE_BYTES]     = proc.get_write_bytes_rate();
+            values[REC_CPU_DELAY]       = proc.get_cpu_delay_rate();
+            values[REC_BLKIO_DELAY]     = proc.get_blkio_delay_rate();
+            values[REC_SWAPIN_DELAY]    = proc.get_swapin_delay_rate();
+            values[REC_MINOR_FAULTS]    = proc.get_minor_faults_rate();
+            values[REC_MAJOR_FAULTS]    = proc.get_major_faults_rate();
+            values[REC_VOL_CTXT]        = proc.get_vol_ctxt_switches_rate();
+            values[REC_INVOL_CTXT]      = proc.get_invol_ctxt_switches_rate();
+        }
+        recorder->commit();
+        recorder_time_ns = monotonic_ns() - start_ns;
+    }
+
+    // Read ahead the files of the known processes that come next in the scan, with one batch.
+    // Return where the next batch starts
+    size_t read_ahead(const vector<pid_t>& vPids, size_t start, size_t i)
+    {
+        for (; i < vPids.size(); i++) {
+            auto it = map_processes.find(vPids[(start + i) % vPids.size()]);
+            if (it != map_processes.end() && !it->second.queue_reads(*batch))
+                break;
+        }
+        batch->run();
+        return i;
+    }
+
+    // Read the host pressure and, if so configured, open or close the gate of the taskstats
+    void read_pressure()
+    {
+        bool available = psi.refresh();
+        if (pressureGate > 0) {
+            // without PSI, there is no telling; collect them
+            bool open = !available || psi.max_some_avg10() >= pressureGate;
+            MonPID::set_taskstats(taskstats && open);
+            if (!open)
+                taskstats_gated++;
+        }
+    }
+
+    static OVLValue process_cpu_ns()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    bool scan_all_processes()
+    {
+        OVLValue start_ns = monotonic_ns();
+        OVLValue start_cpu_ns = process_cpu_ns();
+        gone_processes = 0;
+        // the CPU budget is a share of the time since the previous scan
+        OVLValue cpu_budget_ns = (maxCPU > 0 && last_scan_ns) ?
+            OVLValue(maxCPU / 100 * (start_ns - last_scan_ns)) : 0;
+        MonPID::set_cycle_ns(last_scan_ns ? start_ns - last_scan_ns : 0);
+        last_scan_ns = start_ns;
+
+        // before the processes, since it may decide on their taskstats
+        if (pressure || pressureGate > 0)
+            read_pressure();
+
+        // List all PID (numeric) subdirectories of /proc, and find the gone ones
+        vector<pid_t> vPids, vAdded, vGone;
+        if (!procdir.list("/proc", vPids))
+            return false;
+        ProcDir::diff(vPrevPids, vPids, vAdded, vGone);
+        new_processes = vAdded.size();
+        // no netlink request waits past the budget of the scan
+        taskstat::set_deadline(maxCycleMs ? start_ns + OVLValue(maxCycleMs) * M : 0);
 
+        for (pid_t pid : vGone) {
+            auto it = map_processes.find(pid);
+            if (it != map_processes.end())
+                remove_process(it);
+        }
 
-        // Scan all PID (numeric) subdirectories of /proc
-        // Add each PID found to map_processes, updating any previously found entries
-        struct dirent *entry;
-        char *endptr = NULL;
+        if (aggregate) sDuplicateProcs.clear();
+        mUserTotals.clear();
+        mUserCounts.clear();
+
+        // Add each PID found to map_processes, updating any previously found entries.
+        // Start from where the previous scan ran out of budget, so that every process
+        // is refreshed within a bounded number of cycles
+        size_t start = lower_bound(vPids.begin(), vPids.end(), resume_pid) - vPids.begin();
+        bool exhausted = false;
+        size_t next_batch = 0;
         strSet proc_names;
         pair<mProcesses_iter, bool>  insert_iter;
+        stale_processes = 0;
 
-        for (entry = readdir (procdir); entry != NULL; entry = readdir (procdir))
+        for (size_t i = 0; i < vPids.size(); i++)
         {
-            pid_t pid = strtol(entry->d_name, &endptr, 10);
-            // Skip non-numeric entries
-            if (*endptr != '\0')
-                continue;
+            pid_t pid = vPids[(start + i) % vPids.size()];
+
+            if (!exhausted && over_budget(i, start_ns, start_cpu_ns, cpu_budget_ns)) {
+                exhausted = true;
+                budget_exhausted++;
+                resume_pid = pid;
+            }
+            if (batch && !exhausted && i == next_batch)
+                next_batch = read_ahead(vPids, start, i);
 
             auto it = map_processes.find(pid);
-            if (it == map_processes.end()) {
+            if (exhausted) {
+                // carry over the last values of the known processes; the new ones can wait
+                if (it == map_processes.end())
+                    continue;
+                // its files may have been read ahead already; they would be stale by the next scan
+                if (batch && i < next_batch)
+                    it->second.discard_reads();
+                it->second.mark_stale();
+                stale_processes++;
+            } else if (it == map_processes.end()) {
                 pair<pid_t, MonPID> newElement (pid, MonPID(pid));
 
                 // a very short-lived process may have been scanned, but ended before it got read
@@ -242,9 +1311,25 @@ public:
                 OvlInfo("New process:\t %u (%s)\n",
                     pid, insert_iter.first->second.get_name().c_str());
                 #endif //DEBUG
-            } else {
-                it->second.update();
-                //it->second.trace();
+            } else if (!it->second.update()) {
+                // it has just ended
+                remove_process(it);
+                continue;
+            }
+
+            if (rollup)
+                tree.update(pid, it->second.get_ppid());
+
+            if (it->second.is_excluded())
+                continue;
+
+            if (users) {
+                uid_t uid = it->second.get_uid();
+                auto u_it = mUserTotals.find(uid);
+                if (u_it == mUserTotals.end())
+                    u_it = mUserTotals.insert(make_pair(uid, MonPID::make_total(pid_t(uid)))).first;
+                u_it->second += it->second;
+                mUserCounts[uid]++;
             }
 
             // track duplicate instances of executables
@@ -255,23 +1340,12 @@ public:
             else if(aggregate)
                 sDuplicateProcs.insert(name);
         }
+        if (!exhausted)
+            resume_pid = 0;
 
-        if (closedir(procdir))
-            OvlError("Failed to close '/proc' dir, errno %d: %s",
-                errno, strerror(errno));
-
-        // Clean up all previously found processes, which however are no longer running
-        auto it = map_processes.begin();
-        while (it != map_processes.end()) {
-            if (! it->second.isfound()) {
-                #ifdef DEBUG
-                OvlInfo("Removed process: %u (%s)\n", it->first, it->second.get_name().c_str());
-                #endif //DEBUG
-                it = map_processes.erase(it);
-            } else
-                ++it;
-        }
-
+        vPrevPids.swap(vPids);
+        taskstat::set_deadline(0);
+        scan_time_ns = monotonic_ns() - start_ns;
         return true;
     }
 
@@ -281,25 +1355,32 @@ public:
     }
 
 
+    // The series of the cycle to write out: all of them, or those that changed
+    string flush_series()
+    {
+        string lines = series.str();
+        series.str("");
+        if (!changes)
+            return lines;
+        changes->next_cycle();
+        return changes->filter(lines);
+    }
+
     void output_top_processes()
     {
 		init_process_name();
         vector<MonPID> vProcsToSort, vProcsInclude;
         unordered_map<string, MonPID> mDuplProc;
 
-        // Track the elapsed time since the last sampling
-        const TimePoint time_sample = SteadyClock::now();
-        int seconds_lapse =  chrono::duration_cast<chrono::seconds>(time_sample - timepoint).count();
-        if (seconds_lapse == 0) seconds_lapse = 1;
-        timepoint = time_sample;
-
         for (const auto& it : map_processes) {
             // Compose a vector out of the map of running processes, for their sorting
             // Keep the 'include procs' in a separate vector, to add them in the end
+            if (it.second.is_excluded())
+                continue;
             string name = it.second.get_name();
             if (sDuplicateProcs.find(name) == sDuplicateProcs.end())
             {
-                if (sIncludeProcs.find(name) == sIncludeProcs.end())
+                if (!it.second.is_included())
                     vProcsToSort.push_back(it.second);
                 else
                     vProcsInclude.push_back(it.second);
@@ -310,13 +1391,14 @@ public:
                     mDuplProc.insert(make_pair(name, it.second));
                 else
                     m_it->second += it.second;
+                if (pss)
+                    mDuplMembers[name].push_back(it.first);
             }
         }
 
         // append the aggregate measurements
         for (const auto& it : mDuplProc) {
-            string name = it.second.get_name();
-            if (sIncludeProcs.find(name) == sIncludeProcs.end())
+            if (!it.second.is_included())
                 vProcsToSort.push_back(it.second);
             else
                 vProcsInclude.push_back(it.second);
@@ -324,54 +1406,20 @@ public:
 
 
         // get the top consumers...
-        // ... of CPU usage
-        top_consumers(minCPU*CPU_jiffies/100/nCores,
-            &MonPID::get_cpu,
-            compare_by_CPU,
-            vProcsToSort,
-            "cpu_usage_topk_rank");
-
-        // ... of Memory
-        top_consumers(minRSS,
-            &MonPID::get_RSS,
-            compare_by_RSS,
-            vProcsToSort,
-            "memory_rss_topk_rank");
-
-        // ... of read bytes
-        top_consumers(minIObytes*seconds_lapse,
-            &MonPID::get_read_bytes_delta,
-            compare_by_IO_Read_Bytes,
-            vProcsToSort,
-            "read_bytes_topk_rank");
-
-        // ... of written bytes
-        top_consumers(minIObytes*seconds_lapse,
-            &MonPID::get_write_bytes_delta,
-            compare_by_IO_Write_Bytes,
-            vProcsToSort,
-            "write_bytes_topk_rank");
-
-        // ... of block I/O delays
-        top_consumers(minIOdelays*seconds_lapse,
-            &MonPID::get_blkio_delay_delta,
-            compare_by_blkio_delay,
-            vProcsToSort,
-            "blkio_delay_topk_rank");
-
-        // ... of swap-in delays
-        top_consumers(minIOdelays*seconds_lapse,
-            &MonPID::get_swapin_delay_delta,
-            compare_by_swapin_delay,
-            vProcsToSort,
-            "swapin_delay_topk_rank");
-
-        // ... of cpu delays
-        top_consumers(minIOdelays*seconds_lapse,
-            &MonPID::get_cpu_delay_delta,
-            compare_by_cpu_delay,
-            vProcsToSort,
-            "cpu_delay_topk_rank");
+        rank_consumers(vProcsToSort, mFinalProcHolder, mRanksTracker, mPrevRanks);
+
+        if (rollup)
+            rollup_processes();
+
+        OVLValue users_start_ns = monotonic_ns();
+        if (users) {
+            vector<MonPID> vUsers;
+            vUsers.reserve(mUserTotals.size());
+            for (const auto& it : mUserTotals)
+                vUsers.push_back(it.second);
+            rank_consumers(vUsers, mUserHolder, mUserRanks, mPrevUserRanks);
+        }
+        users_time_ns = monotonic_ns() - users_start_ns;
 
         // Finally include the explicitly monitored processes; rank them with a fictional 99th order
         for (const auto& it : vProcsInclude) {
@@ -379,14 +1427,20 @@ public:
             mFinalProcHolder[pid] = it;
             mRanksTracker[pid]["cpu_usage_topk_rank"]       = 99;
             mRanksTracker[pid]["memory_rss_topk_rank"]      = 99;
+            mRanksTracker[pid]["memory_growth_topk_rank"]   = 99;
             mRanksTracker[pid]["read_bytes_topk_rank"]      = 99;
             mRanksTracker[pid]["write_bytes_topk_rank"]     = 99;
             mRanksTracker[pid]["blkio_delay_topk_rank"]     = 99;
             mRanksTracker[pid]["swapin_delay_topk_rank"]    = 99;
             mRanksTracker[pid]["cpu_delay_topk_rank"]       = 99;
+            mRanksTracker[pid]["major_faults_topk_rank"]    = 99;
+            mRanksTracker[pid]["involuntary_ctxt_switches_topk_rank"] = 99;
         }
 
 
+        if (pss)
+            refresh_pss();
+
         // the Line Protocol output
         for (const auto& it : mFinalProcHolder) {
 
@@ -396,113 +1450,527 @@ public:
             for (const auto& iit : mRanksTracker[it.first])
                 strRanks << "," << iit.first << "=" << iit.second << "i";
 
-			string name = process_name(it.second.get_name(), it.first);
+			string name = process_name(it.second.get_name(), it.first, mRenameProcs);
 
             //it.second.trace();
 
-            cout << "procstat,process_name=" << name <<
+            // the bursts within the polling period, for the sampled (non-aggregated) processes
+            ostringstream strSamples;
+            SampleStats cpu, read, write;
+            if (sampleInterval && sDuplicateProcs.count(it.second.get_name()) == 0 &&
+                    sampler.summary(it.first, cpu, read, write)) {
+                strSamples <<
+                    ",cpu_usage_avg="   << cpu.avg          <<
+                    ",cpu_usage_max="   << cpu.max          <<
+                    ",cpu_usage_p95="   << cpu.p95          <<
+                    ",read_bytes_avg="  << OVLValue(read.avg)   << 'i' <<
+                    ",read_bytes_max="  << OVLValue(read.max)   << 'i' <<
+                    ",read_bytes_p95="  << OVLValue(read.p95)   << 'i' <<
+                    ",write_bytes_avg=" << OVLValue(write.avg)  << 'i' <<
+                    ",write_bytes_max=" << OVLValue(write.max)  << 'i' <<
+                    ",write_bytes_p95=" << OVLValue(write.p95)  << 'i';
+            }
+
+            series << "procstat,process_name=" << name <<
+                " cpu_usage="       << cpu_usage;
+            output_fields(it.second, series);
+            OVLValue pss_sum, uss_sum;
+            if (pss && get_pss(it.second, pss_sum, uss_sum))
+                series <<
+                    ",memory_pss="  << pss_sum << 'i' <<
+                    ",memory_uss="  << uss_sum << 'i';
+            series <<
+                ",num_threads="     << it.second.get_num_threads()                        << 'i' <<
+                ",priority="        << it.second.get_priority()                           << 'i' <<
+                ",nice="            << it.second.get_nice()                               << 'i';
+            if (it.second.get_stale_cycles())
+                series << ",stale_cycles=" << it.second.get_stale_cycles() << 'i';
+            series <<
+                strSamples.str() <<
+                strRanks.str() << endl;
+
+            if (threadTopM)
+                output_threads(it.second, name);
+        }
+
+        // the subtree totals of the rollup
+        unordered_map<string, vector<int>> mRenameTrees;
+        for (const auto& it : mRollupHolder) {
+
+            float cpu_usage = 100*nCores * it.second.get_cpu()/(float) CPU_jiffies;
+            float reaped_cpu_usage = 100*nCores * it.second.get_cchild_cpu()/(float) CPU_jiffies;
+
+            ostringstream strRanks;
+            for (const auto& iit : mRollupRanks[it.first])
+                strRanks << "," << iit.first << "=" << iit.second << "i";
+
+            string name = process_name(it.second.get_name(), it.first, mRenameTrees);
+
+            series << "procstat_tree,process_name=" << name <<
                 " cpu_usage="       << cpu_usage                                          <<
-                ",memory_rss="      << it.second.get_RSS()                                << 'i' <<
-                ",read_bytes="      << it.second.get_read_bytes_delta()/seconds_lapse     << 'i' <<
-                ",write_bytes="     << it.second.get_write_bytes_delta()/seconds_lapse    << 'i' <<
-                ",cpu_delay="       << it.second.get_cpu_delay_delta()/M/seconds_lapse    << 'i' <<
-                ",blkio_delay="     << it.second.get_blkio_delay_delta()/M/seconds_lapse  << 'i' <<
-                ",swapin_delay="    << it.second.get_swapin_delay_delta()/M/seconds_lapse << 'i' <<
+                ",reaped_cpu_usage=" << reaped_cpu_usage                                  <<
+                ",processes="       << mRollupCounts[it.first]                            << 'i';
+            output_fields(it.second, series);
+            series <<
                 strRanks.str() << endl;
+        }
 
+        // the per-user totals
+        if (users) {
+            OVLValue start_ns = monotonic_ns();
+            userNames.refresh();
+            for (const auto& it : mUserHolder) {
+                uid_t uid = uid_t(it.first);
+                float cpu_usage = 100*nCores * it.second.get_cpu()/(float) CPU_jiffies;
+
+                ostringstream strRanks;
+                for (const auto& iit : mUserRanks[it.first])
+                    strRanks << "," << iit.first << "=" << iit.second << "i";
+
+                series << "procstat_user,user=" << userNames.name(uid) <<
+                    " uid="             << uid                                            << 'i' <<
+                    ",cpu_usage="       << cpu_usage                                      <<
+                    ",processes="       << mUserCounts[uid]                               << 'i';
+                output_fields(it.second, series);
+                series <<
+                    strRanks.str() << endl;
+            }
+            users_time_ns += monotonic_ns() - start_ns;
         }
 
-        #ifdef DEBUG
-            cout << endl;
-        #endif
+        // the host pressure
+        if (pressure)
+            for (int r = 0; r < Pressure::NRESOURCES; r++) {
+                const Pressure::Resource& res = psi.get(r);
+                if (!res.available)
+                    continue;
+                const Pressure::Stall& some = res.stall[Pressure::SOME];
+                const Pressure::Stall& full = res.stall[Pressure::FULL];
+                series << "procstat_pressure,resource=" << res.name <<
+                    " some_avg10="      << some.avg10                       <<
+                    ",some_avg60="      << some.avg60                       <<
+                    ",some_total="      << some.total_delta                 << 'i' <<
+                    ",full_avg10="      << full.avg10                       <<
+                    ",full_avg60="      << full.avg60                       <<
+                    ",full_total="      << full.total_delta                 << 'i' << endl;
+            }
+
+        string lines = flush_series();
+
+        // procstat's own metrics, always
+        series << "procstat_internal" <<
+            " processes="   << map_processes.size()     << 'i' <<
+            ",pid_reuses="  << MonPID::get_pid_reuses() << 'i' <<
+            ",new_processes="  << new_processes      << 'i' <<
+            ",gone_processes=" << gone_processes     << 'i' <<
+            ",scan_time_us=" << scan_time_ns / K        << 'i' <<
+            ",poll_latency_us=" << poll_latency_ns / K  << 'i' <<
+            ",polls_coalesced=" << polls_coalesced      << 'i';
+        if (maxCycleMs || maxCPU > 0)
+            series <<
+                ",stale_processes="  << stale_processes  << 'i' <<
+                ",budget_exhausted=" << budget_exhausted << 'i';
+        if (sampleInterval)
+            series <<
+                ",sampler_samples=" << sampler.get_samples() << 'i' <<
+                ",sampler_time_us=" << sampler.get_time_us() << 'i';
+        if (pressureGate > 0)
+            series <<
+                ",taskstats_gated=" << taskstats_gated      << 'i';
+        if (taskstats) {
+            const taskstat::Counters& netlink = taskstat::get_counters();
+            series <<
+                ",netlink_timeouts="   << netlink.timeouts   << 'i' <<
+                ",netlink_stale="      << netlink.stale      << 'i' <<
+                ",netlink_enobufs="    << netlink.enobufs    << 'i' <<
+                ",netlink_reconnects=" << netlink.reconnects << 'i';
+        }
+        if (users)
+            series <<
+                ",users="           << mUserTotals.size()   << 'i' <<
+                ",users_time_us="   << users_time_ns / K    << 'i';
+        if (batch)
+            series <<
+                ",batch_reads="     << batch->get_reads()   << 'i' <<
+                ",batch_enters="    << batch->get_enters()  << 'i';
+        if (snapshot)
+            series <<
+                ",snapshot_truncated=" << snapshot->get_truncated()  << 'i' <<
+                ",snapshot_time_us="   << snapshot_time_ns / K       << 'i';
+        if (recorder)
+            series <<
+                ",recorder_frame_bytes=" << recorder->get_frame_bytes()         << 'i' <<
+                ",recorder_span_s="      << recorder->get_span_ns() / (K*M)     << 'i' <<
+                ",recorder_time_us="     << recorder_time_ns / K                << 'i';
+        if (metrics)
+            series <<
+                ",metrics_scrapes="     << metrics->get_scrapes()   << 'i' <<
+                ",metrics_time_us="     << metrics_time_ns / K      << 'i';
+        if (query)
+            series <<
+                ",query_requests="  << query->get_requests() << 'i' <<
+                ",query_dropped="   << query->get_dropped()  << 'i';
+        if (changes)
+            series <<
+                ",suppressed_lines=" << changes->get_suppressed() << 'i';
+        if (pss)
+            series <<
+                ",pss_reads="       << pss_reads            << 'i' <<
+                ",pss_deferred="    << pss_deferred         << 'i' <<
+                ",pss_time_us="     << pss_time_ns / K      << 'i';
+        series <<
+            ",output_pending="  << output.get_pending()      << 'i' <<
+            ",output_dropped="  << output.get_dropped()      << 'i' <<
+            ",output_stall_ms=" << output.get_stall_ns() / M << 'i' << endl;
+    #ifdef DEBUG
+        series << endl;
+    #endif
+        lines += series.str();
+        series.str("");
+        output.push(lines);
 
+        if (threadTopM)
+            track_threads();
     }
 
 };
 
 
 
-static void sig_handler(int sig)
-{
-    newPoll = 1;
-}
+typedef unordered_map<string, string> mConfig;
 
-inline string parseEnv(const char* var)
+// A setting of the configuration file, or else of the environment
+inline string parseEnv(const char* var, const mConfig& config)
 {
+    auto it = config.find(var);
+    if (it != config.end()) return it->second;
 	char* s = getenv(var);
     if (s) return s;
     return "";
 }
 
-void getEnvVars(Measurements& measurements) {
+// Read a configuration file of "name=value" lines, with the same names as the environment
+bool readConfigFile(const string& path, mConfig& config)
+{
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == NULL) {
+        OvlError("fopen(%s) failed, errno %d: %s", path.c_str(), errno, strerror(errno));
+        return false;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof line, file)) {
+        string str(line);
+        // skip the comments and the blank lines
+        size_t start = str.find_first_not_of(" \t");
+        if (start == string::npos || str[start] == '#' || str[start] == '\n')
+            continue;
+        size_t eq = str.find('=', start);
+        if (eq == string::npos) {
+            OvlWarn("%s: ignoring line '%s'", path.c_str(), str.c_str());
+            continue;
+        }
+        size_t end = str.find_last_not_of(" \t\r\n");
+        string name = str.substr(start, str.find_last_not_of(" \t", eq - 1) + 1 - start);
+        string value = (end > eq) ? str.substr(eq + 1, end - eq) : "";
+        value.erase(0, value.find_first_not_of(" \t"));
+        config[name] = value;
+    }
+    fclose(file);
+    return true;
+}
+
+void getEnvVars(Settings& settings, const mConfig& config) {
 
     string var;
-    var = parseEnv("bucket_size");
+    var = parseEnv("bucket_size", config);
     if (!var.empty())
-        measurements.set_bucket_size(stoi(var));
+        settings.set_bucket_size(stoi(var));
 
-    var = parseEnv("aggregate");
+    var = parseEnv("aggregate", config);
     if (var == "true" || var == "True")
-        measurements.set_aggregate();
+        settings.set_aggregate();
 
-    var = parseEnv("minCPU");
+    var = parseEnv("minCPU", config);
     if (!var.empty())
-        measurements.set_minCPU(stof(var));
+        settings.set_minCPU(stof(var));
 
-    var = parseEnv("minRSS");           // in MB
+    var = parseEnv("minRSS", config);           // in MB
     if (!var.empty())
-        measurements.set_minRSS(stoi(var)*M);
+        settings.set_minRSS(stoi(var)*M);
 
-    var = parseEnv("minIObytes");       // in KB
+    var = parseEnv("minRSSGrowth", config);     // in MB/min
     if (!var.empty())
-        measurements.set_minIObytes(stoi(var)*K);
+        settings.set_minRSSGrowth(stof(var)*M);
 
-    var = parseEnv("minIOdelays");      // in msec
+    var = parseEnv("minIObytes", config);       // in KB
     if (!var.empty())
-        measurements.set_minIOdelays(stoi(var)*M);
+        settings.set_minIObytes(stoi(var)*K);
 
-    var = parseEnv("includeProcs");
+    var = parseEnv("minIOdelays", config);      // in msec
     if (!var.empty())
-        measurements.set_includeProcs(var);
-}
+        settings.set_minIOdelays(stoi(var)*M);
+
+    var = parseEnv("minMajorFaults", config);   // per sec
+    if (!var.empty())
+        settings.set_minMajorFaults(stof(var));
 
+    var = parseEnv("minCtxSwitches", config);   // involuntary, per sec
+    if (!var.empty())
+        settings.set_minCtxSwitches(stof(var));
 
+    var = parseEnv("rollup", config);
+    if (var == "true" || var == "True")
+        settings.set_rollup();
 
-// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
-// ########### MAIN ############
-// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+    var = parseEnv("users", config);
+    if (var == "true" || var == "True")
+        settings.set_users();
 
-int main() {
+    var = parseEnv("rollupDepth", config);
+    if (!var.empty())
+        settings.set_rollupDepth(stoi(var));
+
+    var = parseEnv("rollupRoots", config);
+    if (!var.empty())
+        settings.set_rollupRoots(var);
+
+    var = parseEnv("sampleInterval", config);   // in msec
+    if (!var.empty())
+        settings.set_sampleInterval(stoi(var));
+
+    var = parseEnv("sampleTopN", config);
+    if (!var.empty())
+        settings.set_sampleTopN(stoi(var));
+
+    var = parseEnv("threadTopM", config);
+    if (!var.empty())
+        settings.set_threadTopM(stoi(var));
+
+    var = parseEnv("pss", config);
+    if (var == "true" || var == "True")
+        settings.set_pss();
+
+    var = parseEnv("pssRefresh", config);       // in sec
+    if (!var.empty())
+        settings.set_pssRefresh(stoi(var));
+
+    var = parseEnv("pssBudget", config);        // in msec
+    if (!var.empty())
+        settings.set_pssBudget(stoi(var));
+
+    var = parseEnv("maxCycleMs", config);       // in msec
+    if (!var.empty())
+        settings.set_maxCycleMs(stoi(var));
 
+    var = parseEnv("maxCPU", config);           // in % of one core
+    if (!var.empty())
+        settings.set_maxCPU(stof(var));
+
+    var = parseEnv("ioUring", config);
+    if (var == "true" || var == "True")
+        settings.set_ioUring();
+
+    var = parseEnv("pressure", config);
+    if (var == "true" || var == "True")
+        settings.set_pressure();
+
+    var = parseEnv("pressureGate", config);   // in %
+    if (!var.empty())
+        settings.set_pressureGate(stof(var));
 
-    // Establish signal handling for SIGUSR1
-    if (signal(SIGUSR1, sig_handler) == SIG_ERR) {
-        OvlError("Failed to establish signal handler\n");
-        return 2;
+    var = parseEnv("includeProcs", config);
+    if (!var.empty())
+        settings.set_includeProcs(var);
+
+    var = parseEnv("excludeProcs", config);
+    if (!var.empty())
+        settings.set_excludeProcs(var);
+    settings.compile_rules();
+
+    var = parseEnv("stateFile", config);
+    if (!var.empty())
+        settings.set_stateFile(var);
+
+    var = parseEnv("taskstats", config);
+    if (var == "false" || var == "False")
+        settings.set_taskstats(false);
+
+    var = parseEnv("querySocket", config);
+    if (!var.empty())
+        settings.set_querySocket(var);
+
+    var = parseEnv("snapshotFile", config);
+    if (!var.empty())
+        settings.set_snapshotFile(var);
+
+    var = parseEnv("snapshotMaxProcs", config);
+    if (!var.empty())
+        settings.set_snapshotMaxProcs(stoi(var));
+
+    var = parseEnv("recorderFile", config);
+    if (!var.empty())
+        settings.set_recorderFile(var);
+
+    var = parseEnv("recorderSizeMB", config);
+    if (!var.empty())
+        settings.set_recorderSizeMB(stoi(var));
+
+    var = parseEnv("metricsListen", config);
+    if (!var.empty())
+        settings.set_metricsListen(var);
+
+    var = parseEnv("pollInterval", config);     // in msec
+    if (!var.empty())
+        settings.set_pollInterval(stoi(var));
+
+    var = parseEnv("changeOnly", config);
+    if (var == "true" || var == "True")
+        settings.set_changeOnly();
+
+    var = parseEnv("deadbandPct", config);      // in %
+    if (!var.empty())
+        settings.set_deadbandPct(stof(var));
+
+    var = parseEnv("deadbandAbs", config);
+    if (!var.empty())
+        settings.set_deadbandAbs(stof(var));
+
+    var = parseEnv("keyframeCycles", config);
+    if (!var.empty())
+        settings.set_keyframeCycles(stoi(var));
+
+    var = parseEnv("rankSmoothing", config);    // 0 to 1
+    if (!var.empty())
+        settings.set_rankSmoothing(stof(var));
+
+    var = parseEnv("rankHysteresis", config);   // in %
+    if (!var.empty())
+        settings.set_rankHysteresis(stof(var));
+
+    var = parseEnv("outputQueue", config);      // in cycles
+    if (!var.empty())
+        settings.set_outputQueue(stoi(var));
+
+    var = parseEnv("outputDrop", config);       // oldest or newest
+    if (!var.empty())
+        settings.set_outputDrop(var);
+}
+
+
+
+// Read the settings: the environment, with the configuration file (if any) on top of it.
+// False if any of them is not valid
+bool loadSettings(Settings& settings)
+{
+    mConfig config;
+    char* path = getenv("configFile");
+    if (path && !readConfigFile(path, config))
+        return false;
+
+    try {
+        getEnvVars(settings, config);
+    }
+    catch (const exception& e) {
+        OvlError("Invalid setting (%s)", e.what());
+        return false;
     }
+    return true;
+}
 
+int main() {
+
+    // Blocked before anything else, so that a SIGUSR1 or SIGHUP arriving during the start-up
+    // waits for the loop (which takes them over below), rather than killing procstat
+    sigset_t early;
+    sigemptyset(&early);
+    for (int sig : { SIGUSR1, SIGHUP, SIGTERM, SIGINT })
+        sigaddset(&early, sig);
+    sigprocmask(SIG_BLOCK, &early, NULL);
 
     try {
+        EventLoop loop;
         Measurements measurements;
-        getEnvVars(measurements);
-
-        while (1) {
-    #ifndef DEBUG
-            pause();
-            if (newPoll) {
-    #endif
-                if (measurements.scan_all_processes() && measurements.getCPU())
+        Settings settings;
+        if (!loop.ready() || !loadSettings(settings))
+            return 1;
+        measurements.configure(settings);
+
+        // A poll runs as a task, after the events of its wait: the polls asked for while
+        // one is pending (a late timer, or more signals) are coalesced into it
+        OVLValue poll_asked_ns = 0;     // of the pending poll; 0 for none
+        auto poll = [&]() {
+            measurements.set_poll_latency(monotonic_ns() - poll_asked_ns);
+            poll_asked_ns = 0;
+            if (measurements.scan_all_processes()) {
+                if (measurements.getCPU()) {
+                    measurements.publish_snapshot();
+                    measurements.record_history();
                     measurements.output_top_processes();
-
-                newPoll = 0;
-    #ifndef DEBUG
-            } else
-                break;
-    #else
-            sleep(3);
+                    measurements.expose_metrics();
+                }
+                measurements.checkpoint();
+            }
+            measurements.restart_sampling();
+        };
+        auto ask_poll = [&](uint64_t count) {
+            measurements.add_coalesced_polls(poll_asked_ns ? count : count - 1);
+            if (poll_asked_ns)
+                return;
+            poll_asked_ns = monotonic_ns();
+            loop.post(poll);
+        };
+
+        // the internal polls, if any, and the samples are on a grid from the start
+        // (or a change of their interval); the missed ones are skipped
+        unsigned poll_msec = 0, sample_msec = 0;
+        int poll_timer = loop.add_timer(ask_poll);
+        int sample_timer = loop.add_timer([&](uint64_t) { measurements.sample(); });
+        int expire_timer = loop.add_timer([&](uint64_t) { measurements.expire_clients(); });
+        if (poll_timer < 0 || sample_timer < 0 || expire_timer < 0)
+            return 2;
+        auto set_timers = [&]() {
+            unsigned msec = measurements.get_pollInterval();
+    #ifdef DEBUG
+            if (msec == 0)
+                msec = 3000;
     #endif
+            if (msec != poll_msec && loop.set_timer(poll_timer, OVLValue(msec) * M))
+                poll_msec = msec;
+            msec = measurements.get_sampleInterval();
+            if (msec != sample_msec && loop.set_timer(sample_timer, OVLValue(msec) * M))
+                sample_msec = msec;
+            // the idle connections, once a second
+            loop.set_timer(expire_timer, measurements.has_clients_to_expire() ? K * M : 0);
+        };
+        set_timers();
+
+        // between two cycles; on an invalid configuration, keep going with the current one
+        auto reload = [&]() {
+            Settings reloaded;
+            if (loadSettings(reloaded)) {
+                measurements.configure(reloaded);
+                set_timers();
+                OvlInfo("Configuration reloaded");
+            }
+        };
+
+        // SIGUSR1 (polls), SIGHUP (reloads), SIGTERM and SIGINT (shutdown, once the
+        // output is written out); blocked, so that none interrupts a cycle
+        if (!loop.add_signal(SIGUSR1, [&]() { ask_poll(1); }) ||
+            !loop.add_signal(SIGHUP, [&]() { loop.post(reload); }) ||
+            !loop.add_signal(SIGTERM, [&]() { loop.stop(); }) ||
+            !loop.add_signal(SIGINT, [&]() { loop.stop(); })) {
+            OvlError("Failed to establish signal handler\n");
+            return 2;
         }
 
+        // the output, the queries and the scrapes
+        loop.add_source(
+            [&](vector<pollfd>& fds) { measurements.poll_fds(fds); },
+            [&](const vector<pollfd>& fds) { return measurements.serve_sockets(fds); });
+
+        loop.run();
     }
     catch (const char* e) {
         OvlError("%s\n", e);
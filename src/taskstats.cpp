@@ -19,6 +19,7 @@ You should have received a copy of the GNU General Public License along with thi
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -40,6 +41,26 @@ You should have received a copy of the GNU General Public License along with thi
 #define MAX_MSG_SIZE 1024
 #define MAX_SEND_FAILURES 5
 
+#define NL_REPLY_TIMEOUT_MS	100		// per request, within the deadline
+#define NL_RECONNECT_S		30		// between the attempts to connect
+#define NL_RCVBUF_MAX		(4<<20)	// the receive buffer is doubled on overruns, up to this
+#define NL_LOG_INTERVAL_S	60		// between two reports of the same error
+
+// Report an error, at most once per NL_LOG_INTERVAL_S for each call site; the ones
+// left out in between are counted in the next report
+#define nl_error(msg, ...) do { \
+	static OVLValue last_ns=0; \
+	static unsigned left_out=0; \
+	OVLValue now_ns=monotonic_ns(); \
+	if (last_ns && now_ns-last_ns<NL_LOG_INTERVAL_S*1000000000ULL) \
+		left_out++; \
+	else { \
+		OvlError(msg " (%u more since the last report)", ##__VA_ARGS__, left_out); \
+		last_ns=now_ns; \
+		left_out=0; \
+	} \
+} while (0)
+
 struct msgtemplate {
 	struct nlmsghdr n;
 	struct genlmsghdr g;
@@ -48,8 +69,14 @@ struct msgtemplate {
 
 static int nl_sock=-1;
 static int nl_fam_id=0;
-
-static int send_cmd(int sock_fd,__u16 nlmsg_type,__u32 nlmsg_pid,__u8 genl_cmd,__u16 nla_type,void *nla_data,int nla_len) {
+static __u32 nl_seq=0;				// of the last request
+static bool nl_unanswered=false;	// a reply may still be on its way
+static bool nl_lost=false;			// for a failure, rather than closed on purpose
+static OVLValue nl_deadline_ns=0;
+static OVLValue nl_next_connect_ns=0;
+static taskstat::Counters counters;
+
+static int send_cmd(int sock_fd,__u16 nlmsg_type,__u32 nlmsg_seq,__u8 genl_cmd,__u16 nla_type,void *nla_data,int nla_len) {
 	struct nlattr *na;
 	struct sockaddr_nl nladdr;
 	int r,buflen;
@@ -64,8 +91,8 @@ static int send_cmd(int sock_fd,__u16 nlmsg_type,__u32 nlmsg_pid,__u8 genl_cmd,_
 	msg.n.nlmsg_len=NLMSG_LENGTH(GENL_HDRLEN);
 	msg.n.nlmsg_type=nlmsg_type;
 	msg.n.nlmsg_flags=NLM_F_REQUEST;
-	msg.n.nlmsg_seq=0;
-	msg.n.nlmsg_pid=nlmsg_pid;
+	msg.n.nlmsg_seq=nlmsg_seq;
+	msg.n.nlmsg_pid=0;
 	msg.g.cmd=genl_cmd;
 	msg.g.version=TASKSTATS_GENL_VERSION;
 
@@ -84,13 +111,99 @@ static int send_cmd(int sock_fd,__u16 nlmsg_type,__u32 nlmsg_pid,__u8 genl_cmd,_
 		if (r>0) {
 			buf+=r;
 			buflen-=r;
-		} else
-			if (errno!=EAGAIN)
+		} else if (errno==EAGAIN||errno==EWOULDBLOCK) {
+			struct pollfd pfd={sock_fd,POLLOUT,0};
+			if (poll(&pfd,1,NL_REPLY_TIMEOUT_MS)<=0)
 				return -1;
+		} else if (errno!=EINTR)
+			return -1;
 	}
 	return 0;
 }
 
+// Drop whatever is in the receive buffer: the replies to the requests that timed out
+static void drain_replies(int sock_fd) {
+	struct msgtemplate msg;
+	ssize_t rv;
+
+	while ((rv=recv(sock_fd,&msg,sizeof msg,MSG_DONTWAIT))>0||(rv<0&&(errno==EINTR||errno==ENOBUFS)))
+		if (rv>0)
+			counters.stale++;
+	nl_unanswered=false;
+}
+
+// The replies were more than the receive buffer could hold; make it bigger
+static void grow_rcvbuf(int sock_fd) {
+	int size=0;
+	socklen_t len=sizeof size;
+
+	counters.enobufs++;
+	// the kernel reports the double of what was asked for; asking for that doubles it
+	if (getsockopt(sock_fd,SOL_SOCKET,SO_RCVBUF,&size,&len)<0||size/2>=NL_RCVBUF_MAX)
+		return;
+	if (size>NL_RCVBUF_MAX)
+		size=NL_RCVBUF_MAX;
+	if (setsockopt(sock_fd,SOL_SOCKET,SO_RCVBUF,&size,sizeof size)<0)
+		nl_error("Failed to enlarge the netlink receive buffer to %d: %s",size,strerror(errno));
+}
+
+// Send a request and wait for its reply, until NL_REPLY_TIMEOUT_MS or the deadline,
+// whichever comes first. The replies to earlier requests are dropped on the way.
+// An overrun of the receive buffer may have lost the reply; the request is sent once more.
+static nl_rc request(int sock_fd,__u16 nlmsg_type,__u8 genl_cmd,__u16 nla_type,void *nla_data,int nla_len,
+                     struct msgtemplate *reply,ssize_t *reply_len) {
+	OVLValue now_ns=monotonic_ns();
+	if (nl_deadline_ns&&now_ns>=nl_deadline_ns) {
+		counters.timeouts++;
+		return TIMEOUT;
+	}
+	if (nl_unanswered)
+		drain_replies(sock_fd);
+
+	for (int attempt=0;attempt<2;attempt++) {
+		__u32 seq=++nl_seq;
+		if (send_cmd(sock_fd,nlmsg_type,seq,genl_cmd,nla_type,nla_data,nla_len))
+			return FAIL;
+		nl_unanswered=true;
+
+		OVLValue until_ns=monotonic_ns()+NL_REPLY_TIMEOUT_MS*1000000ULL;
+		if (nl_deadline_ns&&nl_deadline_ns<until_ns)
+			until_ns=nl_deadline_ns;
+		while (1) {
+			ssize_t rv=recv(sock_fd,reply,sizeof *reply,0);
+			if (rv>=0) {
+				if (!NLMSG_OK((&reply->n),(size_t)rv))
+					continue;
+				if (reply->n.nlmsg_seq!=seq) {
+					counters.stale++;
+					continue;
+				}
+				nl_unanswered=false;
+				*reply_len=rv;
+				return SUCCESS;
+			}
+			if (errno==EINTR)
+				continue;
+			if (errno==ENOBUFS) {
+				grow_rcvbuf(sock_fd);
+				break;
+			}
+			if (errno!=EAGAIN&&errno!=EWOULDBLOCK)
+				return CRITICAL_FAIL;
+
+			now_ns=monotonic_ns();
+			if (now_ns>=until_ns) {
+				counters.timeouts++;
+				return TIMEOUT;
+			}
+			struct pollfd pfd={sock_fd,POLLIN,0};
+			poll(&pfd,1,(int)((until_ns-now_ns+999999)/1000000));
+		}
+	}
+	counters.timeouts++;
+	return TIMEOUT;
+}
+
 static int get_family_id(int sock_fd) {
 	struct msgtemplate answ;
 	static char name[256];
@@ -99,11 +212,9 @@ static int get_family_id(int sock_fd) {
 	int id=0;
 
 	strcpy(name,TASKSTATS_GENL_NAME);
-	if (send_cmd(sock_fd,GENL_ID_CTRL,getpid(),CTRL_CMD_GETFAMILY,CTRL_ATTR_FAMILY_NAME,(void *)name,strlen(TASKSTATS_GENL_NAME)+1))
+	if (request(sock_fd,GENL_ID_CTRL,CTRL_CMD_GETFAMILY,CTRL_ATTR_FAMILY_NAME,(void *)name,strlen(TASKSTATS_GENL_NAME)+1,&answ,&rep_len)!=SUCCESS)
 		return 0;
-
-	rep_len=recv(sock_fd,&answ,sizeof answ,0);
-	if (rep_len<0||!NLMSG_OK((&answ.n),(size_t)rep_len)||answ.n.nlmsg_type==NLMSG_ERROR)
+	if (answ.n.nlmsg_type==NLMSG_ERROR)
 		return 0;
 
 	na=(struct nlattr *)GENLMSG_DATA(&answ);
@@ -115,71 +226,101 @@ static int get_family_id(int sock_fd) {
 }
 
 nl_rc taskstat::nl_init(void) {
+	static bool registered=false;
 	struct sockaddr_nl addr;
-	int sock_fd=socket(PF_NETLINK,SOCK_RAW,NETLINK_GENERIC);
-
-	atexit(nl_fini);
 
+	nl_fini();
+	if (!registered) {
+		atexit(nl_fini);
+		registered=true;
+	}
+	int sock_fd=socket(PF_NETLINK,SOCK_RAW|SOCK_NONBLOCK|SOCK_CLOEXEC,NETLINK_GENERIC);
 	if (sock_fd<0)
 		goto error;
 
 	memset(&addr,0,sizeof addr);
 	addr.nl_family=AF_NETLINK;
 
-	if (bind(sock_fd,(struct sockaddr *)&addr,sizeof addr)<0)
+	if (bind(sock_fd,(struct sockaddr *)&addr,sizeof addr)<0) {
+		close(sock_fd);
 		goto error;
+	}
 
-	nl_sock=sock_fd;
-	nl_fam_id=get_family_id(sock_fd);
+	{
+		// connecting is not held to the deadline of the cycle
+		OVLValue deadline_ns=nl_deadline_ns;
+		nl_deadline_ns=0;
+		nl_unanswered=false;
+		nl_fam_id=get_family_id(sock_fd);
+		nl_deadline_ns=deadline_ns;
+	}
 	if (!nl_fam_id) {
-		fprintf(stderr,"nl_init: couldn't get netlink family id\n");
-        return CRITICAL_FAIL;
+		close(sock_fd);
+		nl_lost=true;
+		nl_next_connect_ns=monotonic_ns()+NL_RECONNECT_S*1000000000ULL;
+		nl_error("nl_init: couldn't get netlink family id; retrying in %d sec",NL_RECONNECT_S);
+		return CRITICAL_FAIL;
 	}
 
+	nl_sock=sock_fd;
+	if (nl_lost)
+		counters.reconnects++;
+	nl_lost=false;
 	return SUCCESS;
 
 error:
-    nl_fini();
+	nl_lost=true;
+	nl_next_connect_ns=monotonic_ns()+NL_RECONNECT_S*1000000000ULL;
+	nl_error("nl_init: %s; retrying in %d sec",strerror(errno),NL_RECONNECT_S);
+	return CRITICAL_FAIL;
+}
 
-	fprintf(stderr,"nl_init: %s\n",strerror(errno));
-    return CRITICAL_FAIL;
+nl_rc taskstat::nl_reconnect(void) {
+	if (nl_sock>-1)
+		return SUCCESS;
+	if (monotonic_ns()<nl_next_connect_ns)
+		return CRITICAL_FAIL;
+	return nl_init();
 }
 
+void taskstat::set_deadline(OVLValue deadline_ns) { nl_deadline_ns=deadline_ns; }
+
+const taskstat::Counters& taskstat::get_counters() { return counters; }
+
 nl_rc taskstat::nl_taskstats_info(pid_t tid, taskstats* ts_response) {
     static short send_failures_counter = 0;
 
-	if (nl_sock<0) {
-		fprintf(stderr,"nl_taskstats_info: nl_sock is %d",nl_sock);
-        nl_fini();
-        return CRITICAL_FAIL;
-	}
-	if (nl_fam_id==0) { // this will cause recv to wait forever
-		fprintf(stderr,"nl_taskstats_info: nl_fam_id is 0");
+	if (nl_sock<0||nl_fam_id==0) {
+		nl_error("nl_taskstats_info: not connected");
         nl_fini();
+        nl_lost=true;
         return CRITICAL_FAIL;
 	}
 
-	if (send_cmd(nl_sock,nl_fam_id,tid,TASKSTATS_CMD_GET,TASKSTATS_CMD_ATTR_PID,&tid,sizeof tid)) {
-		fprintf(stderr,"nl_taskstats_info: %s\n",strerror(errno));
-        if (++send_failures_counter > MAX_SEND_FAILURES) {
+	struct msgtemplate msg;
+	ssize_t rv;
+	nl_rc rc=request(nl_sock,nl_fam_id,TASKSTATS_CMD_GET,TASKSTATS_CMD_ATTR_PID,&tid,sizeof tid,&msg,&rv);
+	if (rc==TIMEOUT)
+		return TIMEOUT;
+	if (rc!=SUCCESS) {
+		nl_error("nl_taskstats_info: %s",strerror(errno));
+        if (rc==CRITICAL_FAIL||++send_failures_counter > MAX_SEND_FAILURES) {
             send_failures_counter = 0;
-		    fprintf(stderr,"Successive send failures");
             nl_fini();
+            nl_lost=true;
             return CRITICAL_FAIL;
 	    }
         else
 		    return FAIL;
     }
+    send_failures_counter = 0;
 
-
-	struct msgtemplate msg;
-	ssize_t rv=recv(nl_sock,&msg,sizeof msg,0);
-
-	if (rv<0||!NLMSG_OK((&msg.n),(size_t)rv)||msg.n.nlmsg_type==NLMSG_ERROR) {
+	if (msg.n.nlmsg_type==NLMSG_ERROR) {
 		struct nlmsgerr *err = static_cast<nlmsgerr*>NLMSG_DATA(&msg);
 
-		if (err->error!=-ESRCH)
-			fprintf(stderr,"fatal reply error, %d\n",err->error);
+		if (err->error==-ESRCH)
+			return NO_TASK;
+		nl_error("fatal reply error, %d",err->error);
 		return FAIL;
 	}
 
@@ -0,0 +1,133 @@
+/*
+-----------------------------------------------------------------------------
+    procdump
+    Print the history of the processes from the flight recorder of procstat
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+
+#include "RecorderFormat.h"
+
+#define NSEC    1000000000ULL
+
+using namespace std;
+
+
+static void usage()
+{
+    fprintf(stderr, "usage: procdump [-s sec | -f from -t to] [-p pid] [-n top] <recorder file>\n"
+                    "  -s   the last seconds of the recording\n"
+                    "  -f   from this time (sec since the epoch)\n"
+                    "  -t   up to this time (sec since the epoch)\n"
+                    "  -p   only this process\n"
+                    "  -n   only the top processes by CPU usage, of every cycle\n"
+                    "The processes are printed in the line protocol, with the time of their cycle.\n");
+    exit(2);
+}
+
+static void print(const RecorderProcess& proc, const RecorderFrame& frame)
+{
+    const uint64_t* v = proc.values;
+    float cpu_usage = frame.cpu_jiffies ? 100.0 * frame.ncores * v[REC_CPU] / frame.cpu_jiffies : 0;
+    printf("procstat,process_name=%s pid=%di,ppid=%llui,uid=%llui,cpu_usage=%g"
+           ",memory_rss=%llui,memory_swap=%llui,read_bytes=%llui,write_bytes=%llui"
+           ",cpu_delay=%llui,blkio_delay=%llui,swapin_delay=%llui,minor_faults=%llui,major_faults=%llui"
+           ",voluntary_ctxt_switches=%llui,involuntary_ctxt_switches=%llui,num_threads=%llui %llu\n",
+           proc.name.c_str(), proc.pid,
+           (unsigned long long) v[REC_PPID], (unsigned long long) v[REC_UID], cpu_usage,
+           (unsigned long long) v[REC_RSS] << 10, (unsigned long long) v[REC_SWAP] << 10,
+           (unsigned long long) v[REC_READ_BYTES], (unsigned long long) v[REC_WRITE_BYTES],
+           (unsigned long long) v[REC_CPU_DELAY] / 1000000,
+           (unsigned long long) v[REC_BLKIO_DELAY] / 1000000,
+           (unsigned long long) v[REC_SWAPIN_DELAY] / 1000000,
+           (unsigned long long) v[REC_MINOR_FAULTS], (unsigned long long) v[REC_MAJOR_FAULTS],
+           (unsigned long long) v[REC_VOL_CTXT], (unsigned long long) v[REC_INVOL_CTXT],
+           (unsigned long long) v[REC_THREADS], (unsigned long long) frame.time_ns);
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t last = 0, from = 0, to = UINT64_MAX;
+    pid_t pid = 0;
+    size_t top = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:f:t:p:n:")) != -1) {
+        switch (opt) {
+        case 's':
+            last = strtoull(optarg, NULL, 10) * NSEC;
+            break;
+        case 'f':
+            from = strtoull(optarg, NULL, 10) * NSEC;
+            break;
+        case 't':
+            to = strtoull(optarg, NULL, 10) * NSEC;
+            break;
+        case 'p':
+            pid = strtol(optarg, NULL, 10);
+            break;
+        case 'n':
+            top = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+
+    RecorderReader reader;
+    if (!reader.open(argv[optind])) {
+        fprintf(stderr, "procdump: %s is not a procstat recording\n", argv[optind]);
+        return 1;
+    }
+
+    vector<RecorderIndex> frames = reader.frames();
+    if (frames.empty())
+        return 0;
+    if (last)
+        from = frames.back().time_ns > last ? frames.back().time_ns - last : 0;
+
+    // every frame is decoded on top of the previous ones, since the last keyframe
+    RecorderProcesses procs;
+    RecorderFrame frame;
+    uint64_t last_seq = 0;
+    unsigned skipped = 0;
+    for (const RecorderIndex& entry : frames) {
+        if (entry.time_ns > to)
+            break;
+        if (!reader.decode(entry, last_seq, procs, frame)) {
+            if (entry.time_ns >= from)
+                skipped++;
+            continue;
+        }
+        if (entry.time_ns < from)
+            continue;
+
+        if (pid) {
+            auto it = procs.find(pid);
+            if (it != procs.end())
+                print(it->second, frame);
+            continue;
+        }
+        vector<const RecorderProcess*> vProcs;
+        for (const auto& it : procs)
+            vProcs.push_back(&it.second);
+        size_t n = (top && top < vProcs.size()) ? top : vProcs.size();
+        partial_sort(vProcs.begin(), vProcs.begin() + n, vProcs.end(),
+            [](const RecorderProcess* a, const RecorderProcess* b) {
+                return a->values[REC_CPU] > b->values[REC_CPU]; });
+        for (size_t i = 0; i < n; i++)
+            print(*vProcs[i], frame);
+    }
+    if (skipped)
+        fprintf(stderr, "procdump: %u cycles could not be decoded (before their first keyframe)\n",
+                skipped);
+
+    return 0;
+}
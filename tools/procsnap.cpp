@@ -0,0 +1,102 @@
+/*
+-----------------------------------------------------------------------------
+    procsnap
+    Print the processes of the shared-memory snapshot of procstat
+
+    Author: CostisC
+-----------------------------------------------------------------------------
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+
+#include "SnapshotFormat.h"
+
+using namespace std;
+
+
+static void usage()
+{
+    fprintf(stderr, "usage: procsnap [-n top] [-w interval] <snapshot file>\n"
+                    "  -n   only the top processes by CPU usage\n"
+                    "  -w   print it again every interval (sec)\n");
+    exit(2);
+}
+
+static void print(const SnapshotCopy& copy, size_t top)
+{
+    vector<const SnapshotRecord*> vProcs;
+    for (const SnapshotRecord& rec : copy.records)
+        vProcs.push_back(&rec);
+    size_t n = (top && top < vProcs.size()) ? top : vProcs.size();
+    partial_sort(vProcs.begin(), vProcs.begin() + n, vProcs.end(),
+        [](const SnapshotRecord* a, const SnapshotRecord* b) { return a->cpu_usage > b->cpu_usage; });
+
+    time_t sec = copy.header.time_ns / 1000000000ULL;
+    char when[32];
+    strftime(when, sizeof when, "%F %T", localtime(&sec));
+    printf("cycle %llu at %s: %u processes", (unsigned long long) copy.header.cycle, when,
+           copy.header.count);
+    if (copy.header.truncated)
+        printf(" (%u left out)", copy.header.truncated);
+    printf("\n%7s %7s %6s %6s %10s %10s %10s %9s %9s  %s\n",
+           "PID", "PPID", "UID", "CPU%", "RSS(KB)", "READ(B/s)", "WRITE(B/s)",
+           "BLKIO(ms)", "CPUD(ms)", "NAME");
+    for (size_t i = 0; i < n; i++) {
+        const SnapshotRecord& rec = *vProcs[i];
+        printf("%7d %7d %6u %6.1f %10llu %10llu %10llu %9llu %9llu  %s\n",
+               rec.pid, rec.ppid, rec.uid, rec.cpu_usage,
+               (unsigned long long) rec.memory_rss / 1024,
+               (unsigned long long) rec.read_bytes,
+               (unsigned long long) rec.write_bytes,
+               (unsigned long long) rec.blkio_delay / 1000000,
+               (unsigned long long) rec.cpu_delay / 1000000,
+               copy.name(rec));
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    size_t top = 0;
+    unsigned interval = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:w:")) != -1) {
+        switch (opt) {
+        case 'n':
+            top = strtoul(optarg, NULL, 10);
+            break;
+        case 'w':
+            interval = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+
+    SnapshotReader reader;
+    if (!reader.open(argv[optind])) {
+        fprintf(stderr, "procsnap: %s is not a procstat snapshot\n", argv[optind]);
+        return 1;
+    }
+
+    SnapshotCopy copy;
+    do {
+        if (!reader.read(copy)) {
+            fprintf(stderr, "procsnap: no snapshot published yet\n");
+            if (!interval)
+                return 1;
+        } else
+            print(copy, top);
+        if (interval) {
+            printf("\n");
+            fflush(stdout);
+            sleep(interval);
+        }
+    } while (interval);
+
+    return 0;
+}